@@ -0,0 +1,58 @@
+#include "admission.h"
+#include "metrics.h"
+#include <zephyr/kernel.h>
+
+static counter refused_source("admission.refused.source");
+static counter refused_global("admission.refused.global");
+
+void token_bucket::refill(int64_t now, uint32_t rate, uint32_t burst){
+    // rate per minute is rate thousandths per 60 ms
+    int64_t gained = (now - last) * rate / 60;
+    tokens = MIN((int64_t)tokens + gained, (int64_t)burst * 1000);
+    last = now;
+}
+
+admission::admission(){
+    global.tokens = CONFIG_MC_ACCEPT_BURST * 1000;
+}
+
+token_bucket &admission::lookup(uint32_t source, int64_t now){
+    for(uint8_t i = 0; i < nsources; i++){
+        if(sources[i].source == source){
+            return sources[i].bucket;
+        }
+    }
+    entry *e;
+    if(nsources < ADMISSION_SOURCES){
+        e = &sources[nsources++];
+    } else {
+        // the address heard from longest ago, its bucket has refilled the most
+        e = &sources[0];
+        for(auto &s : sources){
+            if(s.bucket.last < e->bucket.last){
+                e = &s;
+            }
+        }
+    }
+    e->source = source;
+    e->bucket.tokens = CONFIG_MC_ACCEPT_SOURCE_BURST * 1000;
+    e->bucket.last = now;
+    return e->bucket;
+}
+
+bool admission::admit(uint32_t source, int64_t now){
+    token_bucket &b = lookup(source, now);
+    b.refill(now, CONFIG_MC_ACCEPT_SOURCE_RATE, CONFIG_MC_ACCEPT_SOURCE_BURST);
+    global.refill(now, CONFIG_MC_ACCEPT_RATE, CONFIG_MC_ACCEPT_BURST);
+    if(!b.ready()){
+        refused_source.inc();
+        return false;
+    }
+    if(!global.ready()){
+        refused_global.inc();
+        return false;
+    }
+    b.take();
+    global.take();
+    return true;
+}
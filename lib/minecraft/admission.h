@@ -0,0 +1,43 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+
+#define ADMISSION_SOURCES 16    // addresses remembered, the quietest one makes room
+
+// Refills at rate tokens per minute up to burst, in thousandths of a token
+// so slow rates still refill every few milliseconds.
+struct token_bucket {
+    uint32_t tokens = 0;
+    int64_t last = 0;
+
+    void refill     (int64_t now, uint32_t rate, uint32_t burst);
+    bool ready      () { return tokens >= 1000; }
+    void take       () { tokens -= 1000; }
+};
+
+// Decides in the accept path whether a new connection gets a handshake at
+// all. Every source address has a budget of its own, so one client
+// reconnecting in a loop only locks out itself, and a global budget caps a
+// storm spread over many addresses. Refused connections are closed before
+// a single byte is read, logged in players never notice.
+class admission {
+    public:
+    admission();
+
+    bool admit      (uint32_t source, int64_t now);
+
+    private:
+    struct entry {
+        uint32_t source;
+        token_bucket bucket;
+    };
+
+    token_bucket global;
+    entry sources[ADMISSION_SOURCES];
+    uint8_t nsources = 0;
+
+    token_bucket &lookup(uint32_t source, int64_t now);
+};
+
+#endif
@@ -0,0 +1,100 @@
+#include "decoder.h"
+#include <string.h>
+#include <zephyr/kernel.h>
+
+int getVarInt(const uint8_t *buf, uint32_t size, int32_t *value){
+    int32_t result = 0;
+    for(uint32_t i = 0; i < 5; i++){
+        if(i >= size){
+            return 0;
+        }
+        result |= (int32_t)(buf[i] & 0b01111111) << (7 * i);
+        if((buf[i] & 0b10000000) == 0){
+            *value = result;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+frame_decoder::frame_decoder(uint8_t *_buffer, uint32_t _capacity){
+    buffer = _buffer;
+    capacity = _capacity;
+}
+
+void frame_decoder::reset(){
+    head = 0;
+    tail = 0;
+    release = 0;
+    skipping = 0;
+}
+
+void frame_decoder::compact(){
+    head += release;
+    release = 0;
+    if(head == tail){
+        head = tail = 0;
+    } else if(head > 0){
+        // only a partial frame is left, a few bytes
+        memmove(buffer, buffer + head, tail - head);
+        tail -= head;
+        head = 0;
+    }
+}
+
+uint8_t *frame_decoder::space(uint32_t *size){
+    compact();
+    *size = capacity - tail;
+    return buffer + tail;
+}
+
+void frame_decoder::commit(uint32_t size){
+    tail = MIN(tail + size, capacity);
+}
+
+frame_decoder::result frame_decoder::next(frame_view &f){
+    head += release;
+    release = 0;
+
+    if(skipping){
+        uint32_t n = MIN(skipping, tail - head);
+        head += n;
+        skipping -= n;
+        if(skipping){
+            return NEED_MORE;
+        }
+    }
+
+    int32_t length;
+    int n = getVarInt(buffer + head, tail - head, &length);
+    if(n < 0 || (n > 0 && (length <= 0 || length > FRAME_MAX_LENGTH))){
+        return ERROR;
+    } else if(n == 0){
+        return NEED_MORE;
+    }
+
+    // the id is needed even when the payload is dropped
+    int32_t id;
+    uint32_t avail = MIN(tail - head - n, (uint32_t)length);
+    int m = getVarInt(buffer + head + n, avail, &id);
+    if(m < 0 || (m == 0 && avail == (uint32_t)length) || id < 0){
+        return ERROR; // the id does not fit its frame
+    } else if(m == 0){
+        return NEED_MORE;
+    }
+
+    f.length = length;
+    f.id = id;
+    f.size = length - m;
+    if(n + (uint32_t)length > capacity){
+        f.data = NULL;
+        skipping = n + length;
+        return FRAME;
+    }
+    if(tail - head < n + (uint32_t)length){
+        return NEED_MORE;
+    }
+    f.data = buffer + head + n + m;
+    release = n + length;
+    return FRAME;
+}
@@ -0,0 +1,52 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FRAME_MAX_LENGTH 2097151 // largest length a three byte VarInt holds, the protocol's limit
+
+// returns the number of bytes used, 0 if the varint is not complete yet
+// and -1 if it is malformed
+int getVarInt(const uint8_t *buf, uint32_t size, int32_t *value);
+
+// One complete frame as it sits in the decoder's buffer.
+struct frame_view {
+    uint32_t length;        // as on the wire, id included
+    int32_t id;
+    const uint8_t *data;    // payload after the id, NULL if the frame did not fit the buffer
+    uint32_t size;          // payload bytes
+};
+
+// Splits a byte stream into frames, however it was cut into segments.
+// Bytes go in as they arrive, complete frames come out; nothing ever
+// blocks and all state is kept between calls, so any number of
+// connections can be decoded from one thread. A frame larger than the
+// buffer is still reported, without payload, and skipped as it streams by.
+class frame_decoder {
+    public:
+    enum result {
+        NEED_MORE,  // no complete frame buffered
+        FRAME,      // f holds the next frame, valid until the next call
+        ERROR,      // malformed length, the stream cannot be followed
+    };
+
+    frame_decoder(uint8_t *_buffer, uint32_t _capacity);
+
+    void reset      ();
+    uint8_t *space  (uint32_t *size);   // where the next received bytes go
+    void commit     (uint32_t size);    // that many were written to space()
+    result next     (frame_view &f);
+
+    private:
+    uint8_t *buffer;
+    uint32_t capacity;
+    uint32_t head = 0;      // start of the undecoded bytes
+    uint32_t tail = 0;
+    uint32_t release = 0;   // bytes of the frame handed out last
+    uint32_t skipping = 0;  // rest of an oversized frame still to drop
+
+    void compact    ();
+};
+
+#endif
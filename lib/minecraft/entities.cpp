@@ -0,0 +1,78 @@
+#include "entities.h"
+#include "metrics.h"
+#include <zephyr/kernel.h>
+
+static gauge entity_count("entities");
+
+entity_store::entity_store(bool _counted) : counted(_counted){
+}
+
+entity_id entity_store::create(entity_kind k, uint8_t _owner, double _x, double _y, double _z){
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    uint32_t i;
+    if(nfree > 0){
+        i = free_list[--nfree];
+    } else if(top < MAX_ENTITIES){
+        i = top++;
+    } else {
+        k_spin_unlock(&lock, key);
+        return ENTITY_NONE;
+    }
+    live++;
+    k_spin_unlock(&lock, key);
+
+    x[i] = _x;
+    y[i] = _y;
+    z[i] = _z;
+    vx[i] = 0;
+    vy[i] = 0;
+    vz[i] = 0;
+    yaw[i] = 0;
+    pitch[i] = 0;
+    flags[i] = ENTITY_ON_GROUND;
+    owner[i] = _owner;
+    // a new generation for the slot, 0 is reserved so no id equals ENTITY_NONE
+    generation[i] = (generation[i] + 1) & ENTITY_GENERATION_MASK;
+    if(generation[i] == 0){
+        generation[i] = 1;
+    }
+    compiler_barrier(); // kind last, loops skip the slot until it is complete
+    kind[i] = k;
+    if(counted){
+        entity_count.inc();
+    }
+    return id(i);
+}
+
+void entity_store::destroy(entity_id e){
+    if(!alive(e)){
+        return;
+    }
+    uint32_t i = entity_index(e);
+    kind[i] = ENTITY_FREE;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    free_list[nfree++] = i;
+    live--;
+    k_spin_unlock(&lock, key);
+    if(counted){
+        entity_count.dec();
+    }
+}
+
+bool entity_store::alive(entity_id e){
+    uint32_t i = entity_index(e);
+    return e != ENTITY_NONE && i < top && kind[i] != ENTITY_FREE && id(i) == e;
+}
+
+entity_id entity_store::id(uint32_t index){
+    return (generation[index] << ENTITY_INDEX_BITS) | index;
+}
+
+uint32_t entity_store::count(){
+    return live;
+}
+
+uint32_t entity_store::end(){
+    return top;
+}
@@ -0,0 +1,75 @@
+#ifndef ENTITIES_H
+#define ENTITIES_H
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+
+#define MAX_ENTITIES CONFIG_MC_MAX_ENTITIES
+#define ENTITY_INDEX_BITS 12
+#define ENTITY_GENERATION_MASK 0x7FFFF // keeps ids positive, the protocol sends them signed
+#define ENTITY_NONE 0
+
+#define ENTITY_ON_GROUND BIT(0)
+#define ENTITY_MOVED BIT(1)     // changed since clients were last told
+
+BUILD_ASSERT(MAX_ENTITIES <= (1 << ENTITY_INDEX_BITS), "entity index does not fit the id");
+
+// Entity handle as sent to clients. The low bits index the store, the high
+// bits count how often that slot was reused, so a stale id never reaches a
+// newer entity.
+typedef uint32_t entity_id;
+
+enum entity_kind : uint8_t {
+    ENTITY_FREE,
+    ENTITY_PLAYER,
+    ENTITY_MOB,
+    ENTITY_MIRROR,  // player of a peer shard near the border
+};
+
+static inline uint32_t entity_index(entity_id e){
+    return e & ((1 << ENTITY_INDEX_BITS) - 1);
+}
+
+// Every entity in the world, players included. The state a tick walks over
+// sits in parallel arrays indexed by entity_index(), anything cold (names,
+// sockets, keepalives) stays with the owner, the player slots for players.
+// Only the game thread touches live entities; create() may be called from a
+// connection thread, the entity is complete before anyone can see it.
+class entity_store {
+    public:
+    // hot
+    double x[MAX_ENTITIES];
+    double y[MAX_ENTITIES];
+    double z[MAX_ENTITIES];
+    float vx[MAX_ENTITIES];
+    float vy[MAX_ENTITIES];
+    float vz[MAX_ENTITIES];
+    float yaw[MAX_ENTITIES];
+    float pitch[MAX_ENTITIES];
+    uint8_t flags[MAX_ENTITIES];
+
+    // cold
+    entity_kind kind[MAX_ENTITIES];
+    uint8_t owner[MAX_ENTITIES];        // player slot of players, type of mobs, uuid of mirrors
+    uint32_t generation[MAX_ENTITIES];
+
+    entity_store(bool counted = true); // false keeps a scratch store out of the entities gauge
+
+    entity_id create    (entity_kind k, uint8_t owner, double x, double y, double z);
+    void destroy        (entity_id e);
+    bool alive          (entity_id e);
+    entity_id id        (uint32_t index);
+    uint32_t count      ();
+    uint32_t end        (); // loops over the arrays stop here
+
+    private:
+    struct k_spinlock lock;
+    uint16_t free_list[MAX_ENTITIES];
+    uint32_t nfree = 0;
+    uint32_t top = 0;   // indices above were never handed out
+    uint32_t live = 0;
+    bool counted;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#include "events.h"
+#include <zephyr/kernel.h>
+
+BUILD_ASSERT((EVENT_QUEUE_SIZE & (EVENT_QUEUE_SIZE - 1)) == 0, "EVENT_QUEUE_SIZE must be a power of two");
+
+event_queue::event_queue(){
+    for(uint32_t i = 0; i < EVENT_QUEUE_SIZE; i++){
+        atomic_set(&cells[i].seq, i);
+    }
+    k_sem_init(&ready, 0, 1);
+}
+
+bool event_queue::push(const event &e){
+    uint32_t pos = atomic_get(&head);
+    cell *c;
+
+    while(true){
+        c = &cells[pos & (EVENT_QUEUE_SIZE - 1)];
+        int32_t dif = (int32_t)((uint32_t)atomic_get(&c->seq) - pos);
+        if(dif == 0){
+            if(atomic_cas(&head, pos, pos + 1)){
+                break; // cell is ours
+            }
+        } else if(dif < 0){
+            return false; // consumer has not freed this cell yet
+        }
+        pos = atomic_get(&head);
+    }
+
+    c->e = e;
+    atomic_set(&c->seq, pos + 1); // publish to the consumer
+    k_sem_give(&ready);
+    return true;
+}
+
+bool event_queue::pop(event &e){
+    cell *c = &cells[tail & (EVENT_QUEUE_SIZE - 1)];
+    int32_t dif = (int32_t)((uint32_t)atomic_get(&c->seq) - (tail + 1));
+    if(dif < 0){
+        return false; // empty, or the producer is still writing it
+    }
+
+    e = c->e;
+    atomic_set(&c->seq, tail + EVENT_QUEUE_SIZE); // hand the cell back to producers
+    tail++;
+    return true;
+}
+
+bool event_queue::wait(k_timeout_t timeout){
+    return k_sem_take(&ready, timeout) == 0;
+}
+
+uint32_t event_queue::depth(){
+    return (uint32_t)atomic_get(&head) - tail;
+}
@@ -0,0 +1,66 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+
+#define EVENT_QUEUE_SIZE 64 // power of two
+
+enum event_type : uint8_t {
+    EVENT_JOIN,         // login sequence sent, player becomes visible
+    EVENT_LEAVE,        // connection closed, tear the player down
+    EVENT_POSITION,
+    EVENT_ROTATION,
+    EVENT_POSITION_LOOK,
+    EVENT_CHAT,         // text waits in the player's chat buffer
+    EVENT_KEEPALIVE,
+    EVENT_ANIMATION,
+    EVENT_ACTION,
+    EVENT_TELEPORT_CONFIRM,
+};
+
+// Decoded serverbound packet, small enough to copy around by value.
+struct event {
+    event_type type;
+    uint8_t player;
+    bool on_ground;
+    uint8_t value;      // animation or entity action
+    union {
+        struct {
+            double x, y, z;
+            float yaw, pitch;
+        } move;
+        int64_t keepalive;
+        int32_t teleport;
+    };
+
+    // every field defined, the readers fill in what their packet carries
+    event(event_type _type = EVENT_JOIN, uint8_t _player = 0)
+        : type(_type), player(_player), on_ground(false), value(0), move() {}
+};
+
+// Bounded lock-free multi-producer single-consumer ring. Connection threads
+// push decoded packets, the game logic thread is the only one popping.
+// Each cell carries a sequence number telling producers and the consumer
+// whose turn it is, so no lock is ever taken on the hot path.
+class event_queue {
+    public:
+    event_queue();
+
+    bool push       (const event &e);   // false when full
+    bool pop        (event &e);         // consumer only
+    bool wait       (k_timeout_t timeout);
+    uint32_t depth  ();
+
+    private:
+    struct cell {
+        atomic_t seq;
+        event e;
+    };
+    cell cells[EVENT_QUEUE_SIZE];
+    atomic_t head = ATOMIC_INIT(0);
+    uint32_t tail = 0;
+    struct k_sem ready;
+};
+
+#endif
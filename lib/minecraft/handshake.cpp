@@ -0,0 +1,202 @@
+#include "handshake.h"
+#include "minecraft.h"
+#include "metrics.h"
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/sys/byteorder.h>
+
+#define SEND_STATUS 1
+#define SEND_PONG 2
+
+static gauge pending("handshakes");
+static counter status_served("status.served");
+static counter timed_out("handshakes.timeout");
+static counter refused("handshakes.refused");
+
+static size_t putVarInt(uint8_t *buf, uint32_t value){
+    size_t n = 0;
+    do {
+        uint8_t temp = (uint8_t)(value & 0b01111111);
+        value >>= 7;
+        if (value != 0) {
+            temp |= 0b10000000;
+        }
+        buf[n++] = temp;
+    } while (value != 0);
+    return n;
+}
+
+void handshake::open(int _S){
+    S = _S;
+    state = STATE_HANDSHAKE;
+    deadline = k_uptime_get() + CONFIG_MC_HANDSHAKE_TIMEOUT_MS;
+    sending = 0;
+    sent = 0;
+    decoder.reset();
+    username.clear();
+    pending.inc();
+}
+
+void handshake::close(){
+    if(S >= 0){
+        (void)::close(S);
+    }
+    release();
+}
+
+void handshake::release(){
+    if(S >= 0){
+        pending.dec();
+    }
+    S = -1;
+}
+
+bool handshake::expire(int64_t now){
+    if(S < 0 || now < deadline){
+        return false;
+    }
+    timed_out.inc();
+    close();
+    return true;
+}
+
+void handshake::refuse(const char *reason){
+    // Disconnect (login) with a chat component. The packet only stages it,
+    // there is no queue yet, it goes out here without blocking.
+    packet p(S, NULL, NULL);
+    p.writeVarInt(0x00); // packet id
+    json_text(p).raw("{\"text\":\"").escaped(reason).raw("\"}").end();
+    p.finish();
+    if(!p.truncated){
+        uint8_t head[5];
+        struct iovec iov[1 + OUTBOX_SEGMENTS];
+        iov[0] = {head, putVarInt(head, p.length)};
+        for(uint8_t i = 0; i < p.nsegments; i++){
+            iov[i + 1] = p.segments[i];
+        }
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 1 + p.nsegments;
+        sendmsg(S, &msg, ZSOCK_MSG_DONTWAIT);
+    }
+    refused.inc();
+    close();
+}
+
+handshake::result handshake::feed(minecraft *mc){
+    uint32_t room;
+    uint8_t *to = decoder.space(&room);
+    int ret = recv(S, to, room, ZSOCK_MSG_DONTWAIT);
+    if(ret == 0){
+        return FAILED;
+    } else if(ret < 0){
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? NEED_MORE : FAILED;
+    }
+    decoder.commit(ret);
+    return frames(mc);
+}
+
+handshake::result handshake::resume(minecraft *mc){
+    return frames(mc);
+}
+
+// 1 once the pending reply is out, 0 while the socket is full, -1 on error
+int handshake::reply(minecraft *mc){
+    if(sending == SEND_STATUS){
+        return mc->writeStatus(S, &sent, &status_version);
+    }
+    ssize_t r = send(S, pong + sent, sizeof(pong) - sent, ZSOCK_MSG_DONTWAIT);
+    if(r < 0){
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    sent += r;
+    return sent == sizeof(pong) ? 1 : 0;
+}
+
+handshake::result handshake::frames(minecraft *mc){
+    // a single segment may carry several frames, e.g. handshake + request,
+    // and a frame may be cut anywhere, the decoder keeps it for the next feed
+    frame_view f;
+    frame_decoder::result res;
+    while(true){
+        // replies go out in order and without blocking the accept thread,
+        // the next frame waits until the socket took the previous reply
+        if(sending){
+            int r = reply(mc);
+            if(r <= 0){
+                return r < 0 ? FAILED : NEED_MORE;
+            }
+            uint8_t done = sending;
+            sending = 0;
+            if(done == SEND_PONG){
+                status_served.inc();
+                return DONE;
+            }
+        }
+        if((res = decoder.next(f)) != frame_decoder::FRAME){
+            return res == frame_decoder::ERROR ? FAILED : NEED_MORE;
+        }
+        if(!f.data){
+            return FAILED; // nothing before login is that large
+        }
+        result r = frame(mc, f.id, f.data, f.size);
+        if(r != NEED_MORE){
+            return r;
+        }
+    }
+}
+
+handshake::result handshake::frame(minecraft *mc, int32_t id, const uint8_t *data, uint32_t size){
+    int n;
+    switch(state){
+    case STATE_HANDSHAKE: {
+        int32_t protocol_version, addr_len, next;
+        if(id != 0x00 || (n = getVarInt(data, size, &protocol_version)) <= 0){
+            return FAILED;
+        }
+        data += n;
+        size -= n;
+        if((n = getVarInt(data, size, &addr_len)) <= 0 || addr_len < 0 || n + addr_len + 2 > (int)size){
+            return FAILED;
+        }
+        data += n + addr_len + 2; // we don't need the address or port
+        size -= n + addr_len + 2;
+        if(getVarInt(data, size, &next) <= 0){
+            return FAILED;
+        }
+        if(next == STATE_STATUS){
+            state = STATE_STATUS; // any version may ask for the status
+        } else if(next == STATE_LOGIN && protocol_version == 754){
+            state = STATE_LOGIN;
+        } else {
+            return FAILED; // wrong state or not 1.16.5
+        }
+        return NEED_MORE;
+    }
+    case STATE_STATUS:
+        if(id == 0x00){ // request
+            sending = SEND_STATUS;
+            sent = 0;
+            return NEED_MORE;
+        } else if(id == 0x01 && size == 8){ // ping, echo the payload back
+            pong[0] = 9;
+            pong[1] = 0x01;
+            memcpy(pong + 2, data, 8);
+            sending = SEND_PONG;
+            sent = 0;
+            return NEED_MORE;
+        }
+        return FAILED;
+    case STATE_LOGIN: {
+        int32_t name_len;
+        if(id != 0x00 || (n = getVarInt(data, size, &name_len)) <= 0 || name_len <= 0 ||
+           name_len > USERNAME_LENGTH || n + name_len > (int)size){
+            return FAILED;
+        }
+        username.assign((const char *)data + n, name_len);
+        return LOGIN;
+    }
+    }
+    return FAILED;
+}
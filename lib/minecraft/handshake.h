@@ -0,0 +1,49 @@
+#ifndef HANDSHAKE_H
+#define HANDSHAKE_H
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+#include "decoder.h"
+#include "inline_string.h"
+
+class minecraft;
+
+// Connection that has been accepted but has not logged in yet. Server list
+// pings are answered from here without ever touching a player slot, logins
+// are handed over to a player once the username is known.
+class handshake {
+    public:
+    enum result {
+        NEED_MORE,  // waiting for more bytes
+        DONE,       // status exchange finished, close the socket
+        LOGIN,      // login start received, hand over to a player slot
+        FAILED,     // protocol error or connection closed
+    };
+
+    int S = -1;
+    uint8_t state = 0;
+    int64_t deadline = 0;       // dropped if not logged in or done by then
+    uint8_t sending = 0;        // reply the socket has not taken in full yet
+    uint32_t sent = 0;
+    uint32_t status_version = 0;
+    uint8_t pong[10];
+    uint8_t buffer[288];
+    frame_decoder decoder{buffer, sizeof(buffer)};
+    player_name username;
+
+    void open       (int _S);
+    void close      ();
+    void release    (); // socket was handed over to a player
+    bool expire     (int64_t now); // closes it once past the deadline
+    void refuse     (const char *reason); // login disconnect, then close
+    result feed     (minecraft *mc);
+    result resume   (minecraft *mc); // socket writable again
+    bool writing    () { return sending != 0; }
+
+    private:
+    result frames   (minecraft *mc);
+    result frame    (minecraft *mc, int32_t id, const uint8_t *data, uint32_t size);
+    int reply       (minecraft *mc);
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef INLINE_STRING_H
+#define INLINE_STRING_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define USERNAME_LENGTH 16      // longest name the protocol allows
+#define CHAT_LENGTH 256         // longest serverbound chat message, in bytes here
+
+// String with its storage inline, for the fields that would otherwise put a
+// small allocation on the heap per packet. Longer input is cut at the last
+// whole UTF-8 character that fits. Always NUL terminated.
+template<size_t N>
+struct inline_string {
+    char data[N + 1] = {};
+    uint16_t len = 0;
+
+    const char *c_str() const { return data; }
+    size_t length() const { return len; }
+    bool empty() const { return len == 0; }
+
+    void assign(const char *s, size_t n){
+        len = fit(s, n);
+        memcpy(data, s, len);
+        data[len] = 0;
+    }
+    void assign(const char *s){ assign(s, strlen(s)); }
+    void clear(){ len = 0; data[0] = 0; }
+
+    // bytes of s to keep, never splitting a character
+    static size_t fit(const char *s, size_t n){
+        if(n <= N){
+            return n;
+        }
+        n = N;
+        while(n > 0 && ((uint8_t)s[n] & 0xC0) == 0x80){
+            n--; // s[n] continues the character before the cut
+        }
+        return n;
+    }
+
+    bool operator==(const char *s) const { return strcmp(data, s) == 0; }
+    bool operator!=(const char *s) const { return !(*this == s); }
+};
+
+typedef inline_string<USERNAME_LENGTH> player_name;
+typedef inline_string<CHAT_LENGTH> chat_message;
+
+#endif
@@ -0,0 +1,246 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+#if defined(CONFIG_SYS_HEAP_RUNTIME_STATS)
+#include <zephyr/sys/sys_heap.h>
+#endif
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+// zero initialized before any constructor runs, so registration order does not matter
+static counter *counters = nullptr;
+static gauge *gauges = nullptr;
+static histogram *histograms = nullptr;
+static report *reports = nullptr;
+
+traffic packet_traffic;
+histogram send_latency("send", "us");
+histogram tick_duration("tick", "us");
+
+// REGISTRY
+counter::counter(const char *_name){
+    name = _name;
+    next = counters;
+    counters = this;
+}
+
+gauge::gauge(const char *_name){
+    name = _name;
+    next = gauges;
+    gauges = this;
+}
+
+void gauge::raise(int32_t v){
+    atomic_val_t p = atomic_get(&peak);
+    while(v > p && !atomic_cas(&peak, p, v)){
+        p = atomic_get(&peak);
+    }
+}
+
+void gauge::set(int32_t v){
+    atomic_set(&value, v);
+    raise(v);
+}
+
+void gauge::inc(){
+    raise(atomic_inc(&value) + 1);
+}
+
+report::report(const char *_name, void (*_fn)(metrics_print_t print, void *ctx)){
+    name = _name;
+    fn = _fn;
+    next = reports;
+    reports = this;
+}
+
+histogram::histogram(const char *_name, const char *_unit){
+    name = _name;
+    unit = _unit;
+    next = histograms;
+    histograms = this;
+}
+
+void histogram::record(uint32_t value){
+    uint32_t b = 32 - __builtin_clz(value | 1); // values below 2^b
+    if(value == 0){
+        b = 0;
+    }
+    if(b >= METRICS_BUCKETS){
+        b = METRICS_BUCKETS - 1;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    buckets[b]++;
+    count++;
+    sum += value;
+    if(value > max){
+        max = value;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+uint32_t histogram::percentile(uint32_t pct){
+    uint32_t target = (count * pct + 99) / 100;
+    uint32_t seen = 0;
+    for(int b = 0; b < METRICS_BUCKETS - 1; b++){
+        seen += buckets[b];
+        if(seen >= target && seen > 0){
+            return MIN(1U << b, max);
+        }
+    }
+    return max;
+}
+
+uint32_t histogram::average(){
+    return count ? sum / count : 0;
+}
+
+void traffic::count(int dir, uint32_t id, uint32_t size){
+    if(id >= METRICS_PACKET_IDS){
+        id = METRICS_PACKET_IDS - 1; // lump anything odd together
+    }
+    atomic_inc(&packets[dir][id]);
+    atomic_add(&bytes[dir][id], size);
+}
+
+uint32_t traffic::totalPackets(int dir){
+    uint32_t total = 0;
+    for(int i = 0; i < METRICS_PACKET_IDS; i++){
+        total += atomic_get(&packets[dir][i]);
+    }
+    return total;
+}
+
+uint32_t traffic::totalBytes(int dir){
+    uint32_t total = 0;
+    for(int i = 0; i < METRICS_PACKET_IDS; i++){
+        total += atomic_get(&bytes[dir][i]);
+    }
+    return total;
+}
+
+// REPORTS
+static void printHeap(metrics_print_t print, void *ctx){
+#if defined(CONFIG_SYS_HEAP_RUNTIME_STATS)
+    extern struct k_heap _system_heap;
+    struct sys_memory_stats stats;
+    char line[80];
+
+    sys_heap_runtime_stats_get(&_system_heap.heap, &stats);
+    snprintf(line, sizeof(line), "heap %u B used, %u B peak, %u B free",
+             (unsigned)stats.allocated_bytes, (unsigned)stats.max_allocated_bytes,
+             (unsigned)stats.free_bytes);
+    print(ctx, line);
+#else
+    print(ctx, "heap stats need CONFIG_SYS_HEAP_RUNTIME_STATS");
+#endif
+}
+
+#if defined(CONFIG_THREAD_MONITOR) && defined(CONFIG_THREAD_STACK_INFO)
+struct stack_ctx {
+    metrics_print_t print;
+    void *ctx;
+};
+
+static void printStack(const struct k_thread *thread, void *user_data){
+    struct stack_ctx *sc = (struct stack_ctx *)user_data;
+    size_t unused = 0;
+    size_t size = thread->stack_info.size;
+    char line[80];
+    const char *name = k_thread_name_get((k_tid_t)thread);
+
+    if(k_thread_stack_space_get(thread, &unused) != 0){
+        return;
+    }
+    snprintf(line, sizeof(line), "stack %s %u/%u B", name && name[0] ? name : "?",
+             (unsigned)(size - unused), (unsigned)size);
+    sc->print(sc->ctx, line);
+}
+#endif
+
+static void printStacks(metrics_print_t print, void *ctx){
+#if defined(CONFIG_THREAD_MONITOR) && defined(CONFIG_THREAD_STACK_INFO)
+    struct stack_ctx sc = {print, ctx};
+    k_thread_foreach(printStack, &sc);
+#else
+    print(ctx, "stack usage needs CONFIG_THREAD_MONITOR and CONFIG_THREAD_STACK_INFO");
+#endif
+}
+
+static void printHistogram(metrics_print_t print, void *ctx, histogram *h){
+    char line[96];
+    snprintf(line, sizeof(line), "%s n=%u avg=%u p50<=%u p99<=%u max=%u %s", h->name,
+             h->count, h->average(), h->percentile(50), h->percentile(99), h->max, h->unit);
+    print(ctx, line);
+}
+
+void metrics_summary(metrics_print_t print, void *ctx){
+    char line[96];
+
+    snprintf(line, sizeof(line), "uptime %u s", (unsigned)(k_uptime_get() / 1000));
+    print(ctx, line);
+    snprintf(line, sizeof(line), "in %u pkts %u B, out %u pkts %u B",
+             packet_traffic.totalPackets(METRICS_IN), packet_traffic.totalBytes(METRICS_IN),
+             packet_traffic.totalPackets(METRICS_OUT), packet_traffic.totalBytes(METRICS_OUT));
+    print(ctx, line);
+    printHistogram(print, ctx, &send_latency);
+    printHistogram(print, ctx, &tick_duration);
+    printHeap(print, ctx);
+}
+
+void metrics_dump(metrics_print_t print, void *ctx){
+    char line[96];
+
+    metrics_summary(print, ctx);
+    for(counter *c = counters; c; c = c->next){
+        snprintf(line, sizeof(line), "%s %u", c->name, c->get());
+        print(ctx, line);
+    }
+    for(gauge *g = gauges; g; g = g->next){
+        snprintf(line, sizeof(line), "%s %d (peak %d)", g->name, g->get(), (int)atomic_get(&g->peak));
+        print(ctx, line);
+    }
+    for(histogram *h = histograms; h; h = h->next){
+        if(h != &send_latency && h != &tick_duration){
+            printHistogram(print, ctx, h);
+        }
+    }
+    for(int dir = METRICS_IN; dir <= METRICS_OUT; dir++){
+        for(int id = 0; id < METRICS_PACKET_IDS; id++){
+            uint32_t n = atomic_get(&packet_traffic.packets[dir][id]);
+            if(n == 0){
+                continue;
+            }
+            snprintf(line, sizeof(line), "%s 0x%02x %u pkts %u B", dir == METRICS_IN ? "in" : "out",
+                     id, n, (unsigned)atomic_get(&packet_traffic.bytes[dir][id]));
+            print(ctx, line);
+        }
+    }
+    for(report *r = reports; r; r = r->next){
+        r->fn(print, ctx);
+    }
+    printStacks(print, ctx);
+}
+
+// SHELL
+#if defined(CONFIG_SHELL)
+static void shellPrint(void *ctx, const char *line){
+    shell_print((const struct shell *)ctx, "%s", line);
+}
+
+static int cmd_stats(const struct shell *sh, size_t argc, char **argv){
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+    metrics_dump(shellPrint, (void *)sh);
+    return 0;
+}
+
+// other modules add their own subcommands with SHELL_SUBCMD_ADD((mc), ...)
+SHELL_SUBCMD_SET_CREATE(mc_cmds, (mc));
+SHELL_SUBCMD_ADD((mc), stats, NULL, "Dump all server metrics", cmd_stats, 1, 0);
+SHELL_SUBCMD_SET_CREATE(mc_bench_cmds, (mc, bench));
+SHELL_SUBCMD_ADD((mc), bench, &mc_bench_cmds, "Benchmarks of the simulation kernels", NULL, 1, 0);
+SHELL_CMD_REGISTER(mc, &mc_cmds, "Minecraft server commands", NULL);
+#endif
@@ -0,0 +1,99 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+
+#define METRICS_PACKET_IDS 128 // every 1.16.5 packet id fits in one varint byte
+#define METRICS_BUCKETS 20     // bucket i counts values below 2^i, the last one the rest
+
+#define METRICS_IN 0
+#define METRICS_OUT 1
+
+// Metrics register themselves on construction, so a global instance
+// anywhere in the library shows up in /stats and in the shell dump.
+
+class counter {
+    public:
+    const char *name;
+    atomic_t value = ATOMIC_INIT(0);
+    counter *next;
+
+    counter(const char *_name);
+
+    void inc() { atomic_inc(&value); }
+    void add(uint32_t n) { atomic_add(&value, n); }
+    uint32_t get() { return atomic_get(&value); }
+};
+
+class gauge {
+    public:
+    const char *name;
+    atomic_t value = ATOMIC_INIT(0);
+    atomic_t peak = ATOMIC_INIT(0);
+    gauge *next;
+
+    gauge(const char *_name);
+
+    void set(int32_t v);
+    void inc();
+    void dec() { atomic_dec(&value); }
+    int32_t get() { return atomic_get(&value); }
+
+    private:
+    void raise(int32_t v);
+};
+
+class histogram {
+    public:
+    const char *name;
+    const char *unit;
+    uint32_t buckets[METRICS_BUCKETS] = {0};
+    uint32_t count = 0;
+    uint32_t max = 0;
+    uint64_t sum = 0;
+    struct k_spinlock lock = {};
+    histogram *next;
+
+    histogram(const char *_name, const char *_unit);
+
+    void record(uint32_t value);
+    uint32_t percentile(uint32_t pct); // upper bound of the bucket holding it
+    uint32_t average();
+};
+
+// packets and bytes per packet id in each direction
+class traffic {
+    public:
+    atomic_t packets[2][METRICS_PACKET_IDS] = {};
+    atomic_t bytes[2][METRICS_PACKET_IDS] = {};
+
+    void count(int dir, uint32_t id, uint32_t size);
+    uint32_t totalPackets(int dir);
+    uint32_t totalBytes(int dir);
+};
+
+extern traffic packet_traffic;
+extern histogram send_latency;
+extern histogram tick_duration;
+
+typedef void (*metrics_print_t)(void *ctx, const char *line);
+
+// free form section of the full dump, e.g. per client state
+class report {
+    public:
+    const char *name;
+    void (*fn)(metrics_print_t print, void *ctx);
+    report *next;
+
+    report(const char *_name, void (*_fn)(metrics_print_t print, void *ctx));
+};
+
+// short summary that fits in a few chat lines
+void metrics_summary(metrics_print_t print, void *ctx);
+// every registered metric, per packet id traffic, heap and thread stacks
+void metrics_dump(metrics_print_t print, void *ctx);
+
+#endif
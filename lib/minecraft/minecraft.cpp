@@ -1,307 +1,854 @@
 #include "minecraft.h"
+#include "metrics.h"
 #include <chunk.h>
 #include <cstdint>
-#include <string>
 #include <zephyr/kernel.h>
 #include <zephyr/net/socket.h>
 #include <zephyr/sys/byteorder.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <math.h>
 
+static counter disconnects_eof("disconnect.eof");
+static counter disconnects_error("disconnect.error");
+static counter disconnects_timeout("disconnect.timeout");
+static counter reclaimed("connections.reclaimed");
+static counter events_full("events.full");
+static gauge event_depth("events.depth");
+static gauge mob_count("mobs");
+static counter mobs_deferred("mobs.deferred");
+static histogram mob_tick("mobs", "us");
+static counter game_wakeups("game.wakeups");
+static counter game_idle_ms("game.idle_ms");
+static void idleReport(metrics_print_t print, void *ctx);
+static report idle_section("idle", idleReport);
+
 // PACKET
+static counter truncated_packets("packet.truncated");
+static counter moves_rejected("moves.rejected");
+static counter discarded_packets("packets.discarded");
+static counter malformed_packets("packets.malformed");
+
 void packet::write(uint8_t val){
+    if(index >= sizeof(buffer)){
+        truncated = true;
+        return;
+    }
     buffer[index] = val;
     index++;
+    length++;
 }
 
-void packet::write(uint8_t * buf, size_t size){
-    memcpy((uint8_t *)(buffer + index), std::move(buf), size);
+void packet::write(const uint8_t * buf, size_t size){
+    if(size > sizeof(buffer) - index){
+        truncated = true;
+        return;
+    }
+    memcpy(buffer + index, buf, size);
     index += size;
+    length += size;
 }
 
-void packet::serverWriteVarInt(int32_t value){
-    do {
-        uint8_t temp = (uint8_t)(value & 0b01111111);
-        value = lsr(value,7);
-        if (value != 0) {
-            temp |= 0b10000000;
-        }
-        send(S, &temp, sizeof(temp), 0);
-    } while (value != 0);
+void packet::reference(const uint8_t * buf, size_t size){
+    // the staged bytes before the blob become their own segment, one more
+    // is kept free for whatever is staged after it
+    if(nsegments + 3 > OUTBOX_SEGMENTS){
+        write(buf, size); // out of segments, fall back to copying
+        return;
+    }
+    if(index > staged){
+        segments[nsegments++] = {buffer + staged, index - staged};
+        staged = index;
+    }
+    segments[nsegments++] = {(void *)buf, size};
+    length += size;
 }
 
-void packet::writePacket(){
+void packet::finish(){
+    if(index > staged){
+        segments[nsegments++] = {buffer + staged, index - staged};
+        staged = index;
+    }
+}
+
+void packet::writePacket(uint64_t key){
+    if(truncated){
+        truncated_packets.inc();
+        return;
+    }
+    finish();
 	k_mutex_lock(mtx, K_FOREVER);
-    serverWriteVarInt(index);
-	send(S, buffer, index, 0);
+    uint32_t start = k_cycle_get_32();
+    out->write(S, segments, nsegments, length, key);
+    send_latency.record(k_cyc_to_us_floor32(k_cycle_get_32() - start));
 	k_mutex_unlock(mtx);
+    packet_traffic.count(METRICS_OUT, buffer[0], length);
 }
 
-// SERVERBOUND LOGIN
-uint8_t minecraft::player::readHandShake(){
-    readVarInt(); // length
-    int id = readVarInt(); // packet id
-    int protocol_version = readVarInt();
-    readString(); // we don't need our name
-    readUnsignedShort();
-    int state = readVarInt();
-    if(id != 0){
-        return false;
-    } else if(protocol_version != 754){
-        logerr("wrong protocol version, log in with 1.16.5");
-        return false;
+// JSON TEXT
+json_text::json_text(packet &_p) : p(_p){
+    at = p.index;
+    p.write((uint8_t)0x80); // length, patched by end()
+    p.write((uint8_t)0x00);
+}
+
+json_text &json_text::raw(const char *json){
+    p.write((const uint8_t *)json, strlen(json));
+    return *this;
+}
+
+json_text &json_text::escaped(const char *str){
+    return escaped(str, strlen(str));
+}
+
+json_text &json_text::escaped(const char *str, size_t size){
+    static const char hex[] = "0123456789abcdef";
+    size_t run = 0; // characters written as they are, copied in one go
+    for(size_t i = 0; i < size; i++){
+        uint8_t c = str[i];
+        if(c >= 0x20 && c != '"' && c != '\\'){
+            continue;
+        }
+        p.write((const uint8_t *)str + run, i - run);
+        run = i + 1;
+        if(c == '"' || c == '\\'){
+            uint8_t e[] = {'\\', c};
+            p.write(e, sizeof(e));
+        } else {
+            uint8_t e[] = {'\\', 'u', '0', '0', (uint8_t)hex[c >> 4], (uint8_t)hex[c & 15]};
+            p.write(e, sizeof(e));
+        }
     }
+    p.write((const uint8_t *)str + run, size - run);
+    return *this;
+}
 
-    if(state != 1 && state != 2) {
-        logerr("wrong state");
-        return 0;
-    } else {
-        return state;
+void json_text::end(){
+    if(p.truncated){
+        return; // dropped anyway
     }
+    uint32_t size = p.index - at - 2;
+    p.buffer[at] = (size & 0x7F) | 0x80;
+    p.buffer[at + 1] = size >> 7;
 }
 
-bool minecraft::player::readLoginStart(){
-    readVarInt(); // length
-    int id = readVarInt();
-    if(id != 0){
+// BUNDLE
+bool bundle::stage(const uint8_t *buf, size_t size){
+    if(size > sizeof(buffer) - index){
+        return false;
+    }
+    struct iovec *last = nsegments ? &segments[nsegments - 1] : NULL;
+    if(last && (uint8_t *)last->iov_base + last->iov_len == buffer + index){
+        last->iov_len += size; // continues the previous staged run
+    } else if(nsegments < BUNDLE_SEGMENTS){
+        segments[nsegments++] = {buffer + index, size};
+    } else {
         return false;
     }
-    username = readString();
-    loginfo("player logging in as " + username);
+    memcpy(buffer + index, buf, size);
+    index += size;
+    length += size;
     return true;
 }
 
-uint64_t minecraft::player::readPing(){
-    readVarInt(); // length
-    readVarInt(); // packet id
-    uint64_t payload = readLong(); // payload
-    login("ping " + std::to_string((uint32_t)payload));
-    return payload;
+int32_t bundle::add(packet &p){
+    p.finish();
+    if(p.truncated || nframes == BUNDLE_FRAMES){
+        return -1;
+    }
+    uint8_t hdr[5];
+    uint8_t hlen = 0;
+    uint32_t len = p.length;
+    do {
+        uint8_t temp = (uint8_t)(len & 0b01111111);
+        len >>= 7;
+        if (len != 0) {
+            temp |= 0b10000000;
+        }
+        hdr[hlen++] = temp;
+    } while (len != 0);
+    if(!stage(hdr, hlen)){
+        return -1;
+    }
+    int32_t at = index;
+    for(uint8_t i = 0; i < p.nsegments; i++){
+        const uint8_t *base = (const uint8_t *)p.segments[i].iov_base;
+        size_t size = p.segments[i].iov_len;
+        if(base >= p.buffer && base < p.buffer + sizeof(p.buffer)){
+            if(!stage(base, size)){
+                return -1;
+            }
+        } else if(nsegments < BUNDLE_SEGMENTS){
+            segments[nsegments++] = {(void *)base, size};
+            length += size;
+        } else {
+            return -1;
+        }
+    }
+    ids[nframes] = p.buffer[0];
+    lengths[nframes] = p.length;
+    nframes++;
+    return at;
+}
+
+void bundle::prepare(struct iovec *iov, const uint8_t *staged){
+    // same segments, with the staged runs pointing at the caller's copy
+    for(uint8_t i = 0; i < nsegments; i++){
+        iov[i] = segments[i];
+        uint8_t *base = (uint8_t *)segments[i].iov_base;
+        if(base >= buffer && base < buffer + sizeof(buffer)){
+            iov[i].iov_base = (void *)(staged + (base - buffer));
+        }
+    }
 }
 
-void minecraft::player::readRequest(){
-    readVarInt();
-    readVarInt();
-    login("request packet received");
+void bundle::writeBundle(int S, struct k_mutex *mtx, outbox *out, struct iovec *iov, int n, size_t more){
+	k_mutex_lock(mtx, K_FOREVER);
+    uint32_t start = k_cycle_get_32();
+    out->writeFramed(S, iov, n, length + more);
+    send_latency.record(k_cyc_to_us_floor32(k_cycle_get_32() - start));
+	k_mutex_unlock(mtx);
+    for(uint8_t i = 0; i < nframes; i++){
+        packet_traffic.count(METRICS_OUT, ids[i], lengths[i]);
+    }
 }
 
+// DISPATCH
+// Serverbound packets of protocol 754 by state and id. Packets without a
+// reader are dropped straight from the receive buffer, as are packets
+// whose payload is outside the bounds, before a reader ever sees them.
+typedef minecraft::player P;
+
+static const P::handler play_packets[] = {
+    {&P::readTeleportConfirm, 1, 5},    // 0x00 teleport confirm
+    {},                                 // 0x01 query block nbt
+    {},                                 // 0x02 set difficulty
+    {&P::readChat, 1, 3 + 4 * 256},     // 0x03 chat message, 256 characters
+    {},                                 // 0x04 client status
+    {},                                 // 0x05 client settings
+    {},                                 // 0x06 tab complete
+    {},                                 // 0x07 window confirmation
+    {},                                 // 0x08 click window button
+    {},                                 // 0x09 click window
+    {},                                 // 0x0A close window
+    {},                                 // 0x0B plugin message
+    {},                                 // 0x0C edit book
+    {},                                 // 0x0D query entity nbt
+    {},                                 // 0x0E interact entity
+    {},                                 // 0x0F generate structure
+    {&P::readKeepAlive, 8, 8},          // 0x10 keep alive
+    {},                                 // 0x11 lock difficulty
+    {&P::readPosition, 25, 25},         // 0x12 player position
+    {&P::readPositionAndLook, 33, 33},  // 0x13 player position and rotation
+    {&P::readRotation, 9, 9},           // 0x14 player rotation
+    {},                                 // 0x15 player movement
+    {},                                 // 0x16 vehicle move
+    {},                                 // 0x17 steer boat
+    {},                                 // 0x18 pick item
+    {},                                 // 0x19 craft recipe request
+    {},                                 // 0x1A player abilities
+    {},                                 // 0x1B player digging
+    {&P::readEntityAction, 3, 15},      // 0x1C entity action
+    {},                                 // 0x1D steer vehicle
+    {},                                 // 0x1E set displayed recipe
+    {},                                 // 0x1F set recipe book state
+    {},                                 // 0x20 name item
+    {},                                 // 0x21 resource pack status
+    {},                                 // 0x22 advancement tab
+    {},                                 // 0x23 select trade
+    {},                                 // 0x24 set beacon effect
+    {},                                 // 0x25 held item change
+    {},                                 // 0x26 update command block
+    {},                                 // 0x27 update command block minecart
+    {},                                 // 0x28 creative inventory action
+    {},                                 // 0x29 update jigsaw block
+    {},                                 // 0x2A update structure block
+    {},                                 // 0x2B update sign
+    {&P::readAnimation, 1, 5},          // 0x2C animation
+    {},                                 // 0x2D spectate
+    {},                                 // 0x2E player block placement
+    {},                                 // 0x2F use item
+};
+
+// handshake, status and login are answered by the handshake before a
+// player slot is involved
+static const struct {
+    const P::handler *handlers;
+    uint32_t count;
+} dispatch_tables[] = {
+    {NULL, 0},                                  // STATE_HANDSHAKE
+    {NULL, 0},                                  // STATE_STATUS
+    {NULL, 0},                                  // STATE_LOGIN
+    {play_packets, ARRAY_SIZE(play_packets)},   // STATE_PLAY
+};
+BUILD_ASSERT(ARRAY_SIZE(dispatch_tables) == STATE_PLAY + 1, "one table per state");
+
 // SERVERBOUND PLAY PACKETS
+// These run on the connection thread. They only decode the packet into an
+// event, the game logic thread applies it.
 void minecraft::player::readChat(){
-   std::string m = readString();
-    login("<" + username + "> " + m);
-    if(m == "/stats"){
-    } else {
-        mc->broadcastChatMessage(m, username);
-    }
+    k_sem_take(&chat_free, K_FOREVER); // previous message still being broadcast
+    readString(chat);
+    login("<%s> %s", username.c_str(), chat.c_str());
+    post({EVENT_CHAT, id});
 }
 
 void minecraft::player::readPosition(){
-    x = readDouble();
-    y = readDouble();
-    z = readDouble();
-    on_ground = readBool();
-    mc->broadcastPlayerPosAndLook(x, y, z, yaw_i, pitch_i, on_ground, id);
-    // login("player pos " + std::to_string(x) + " " + std::to_string(y) + " " + std::to_string(z));
+    event e = {EVENT_POSITION, id};
+    e.move.x = readDouble();
+    e.move.y = readDouble();
+    e.move.z = readDouble();
+    e.on_ground = readBool();
+    post(e);
+    // login("player pos %f %f %f", e.move.x, e.move.y, e.move.z);
 }
 
 void minecraft::player::readRotation(){
-    yaw = readFloat();
-    pitch = readFloat();
-    yaw_i = floor(fmap(yaw, 0, 360, 0, 256));
-    pitch_i = floor(fmap(pitch, 0, 360, 0, 256));
-    on_ground = readBool();
-    mc->broadcastPlayerRotation(yaw_i, pitch_i, on_ground, id);
-    // login("player rotation " + std::to_string(yaw) + " " + std::to_string(pitch));
+    event e = {EVENT_ROTATION, id};
+    e.move.yaw = readFloat();
+    e.move.pitch = readFloat();
+    e.on_ground = readBool();
+    post(e);
+    // login("player rotation %f %f", e.move.yaw, e.move.pitch);
 }
 
 void minecraft::player::readKeepAlive(){
-    login("keepalive received: " + std::to_string((long)readLong()));
+    event e = {EVENT_KEEPALIVE, id};
+    e.keepalive = readLong();
+    post(e);
 }
 
 void minecraft::player::readPositionAndLook(){
-    x = readDouble();
-    y = readDouble();
-    z = readDouble();
-    yaw = readFloat();
-    pitch = readFloat();
-    yaw_i = floor(fmap(yaw, 0, 360, 0, 256));
-    pitch_i = floor(fmap(pitch, 0, 360, 0, 256));
-    on_ground = readBool();
-    mc->broadcastPlayerPosAndLook(x, y, z, yaw_i, pitch_i, on_ground, id);
-    // login("player rotation " + std::to_string(yaw) + " " + std::to_string(pitch));
+    event e = {EVENT_POSITION_LOOK, id};
+    e.move.x = readDouble();
+    e.move.y = readDouble();
+    e.move.z = readDouble();
+    e.move.yaw = readFloat();
+    e.move.pitch = readFloat();
+    e.on_ground = readBool();
+    post(e);
+    // login("player rotation %f %f", e.move.yaw, e.move.pitch);
 }
 
 void minecraft::player::readTeleportConfirm(){
-    readVarInt();
-    login("teleport confirm");
+    event e = {EVENT_TELEPORT_CONFIRM, id};
+    e.teleport = readVarInt();
+    post(e);
 }
 
 void minecraft::player::readAnimation(){
-    mc->broadcastEntityAnimation(readVarInt(), id);  
+    event e = {EVENT_ANIMATION, id};
+    e.value = readVarInt();
+    post(e);
 }
 
 void minecraft::player::readEntityAction(){
+    event e = {EVENT_ACTION, id};
     readVarInt(); // we don't need our own id lmao
-    mc->broadcastEntityAction(readVarInt(), id);
+    e.value = readVarInt();
     readVarInt(); // we don't need horse jump boost
+    post(e);
+}
+
+void minecraft::player::post(const event &e){
+    // a full ring pushes back on this connection only
+    while(!mc->events.push(e)){
+        events_full.inc();
+        k_msleep(1);
+    }
+}
+
+// GAME LOGIC
+// Sleeps until the next tick or the next event. An empty server has no
+// tick, nothing moves without players, so it sleeps until someone joins.
+void minecraft::idle(){
+    k_timeout_t timeout = K_FOREVER;
+    if(getPlayerNum() > 0){
+        int64_t next = last_tick + TICK_MS;
+        int64_t now = k_uptime_get();
+        if(next <= now){
+            return;
+        }
+        timeout = K_MSEC(next - now);
+    } else if(events.depth() > 0){
+        return;
+    }
+    int64_t start = k_uptime_get();
+    events.wait(timeout);
+    game_idle_ms.add(k_uptime_get() - start);
+    game_wakeups.inc();
+}
+
+void minecraft::update(){
+    idle();
+    int64_t next = last_tick + TICK_MS;
+
+    uint32_t start = k_cycle_get_32();
+    event e;
+    event_depth.set(events.depth());
+    while(events.pop(e)){
+        apply(e);
+    }
+    flush();
+
+    int64_t now = k_uptime_get();
+    if(now >= next){
+        last_tick = now;
+        tick++;
+        handle();
+    }
+    tick_duration.record(k_cyc_to_us_floor32(k_cycle_get_32() - start));
+}
+
+// wakeups and idle share of the game thread since the previous report
+static void idleReport(metrics_print_t print, void *ctx){
+    static int64_t since = 0;
+    static uint32_t wakeups = 0;
+    static uint32_t idle_ms = 0;
+    char line[96];
+
+    int64_t now = k_uptime_get();
+    uint32_t window = MAX(now - since, 1);
+    uint32_t w = game_wakeups.get();
+    uint32_t i = game_idle_ms.get();
+    snprintf(line, sizeof(line), "game %u wakeups/s, %u%% idle over %u s",
+             (unsigned)((uint64_t)(w - wakeups) * 1000 / window),
+             (unsigned)((uint64_t)(i - idle_ms) * 100 / window), window / 1000);
+    print(ctx, line);
+    since = now;
+    wakeups = w;
+    idle_ms = i;
+
+#if defined(CONFIG_SCHED_THREAD_USAGE_ALL)
+    static uint64_t cpu_idle = 0;
+    static uint64_t cpu_total = 0;
+    k_thread_runtime_stats_t stats;
+    k_thread_runtime_stats_all_get(&stats);
+    uint64_t total = stats.execution_cycles - cpu_total;
+    snprintf(line, sizeof(line), "cpu %u%% idle",
+             (unsigned)(total ? (stats.idle_cycles - cpu_idle) * 100 / total : 100));
+    print(ctx, line);
+    cpu_idle = stats.idle_cycles;
+    cpu_total = stats.execution_cycles;
+#else
+    print(ctx, "cpu idle time needs CONFIG_SCHED_THREAD_USAGE_ALL");
+#endif
+}
+
+void minecraft::apply(const event &e){
+    player &p = players[e.player];
+
+    switch(e.type){
+    case EVENT_JOIN:
+        p.enter();
+        break;
+    case EVENT_LEAVE:
+        p.leave();
+        break;
+    case EVENT_POSITION:
+    case EVENT_ROTATION:
+    case EVENT_POSITION_LOOK: {
+        if(e.type != EVENT_ROTATION && !p.move(e)){
+            break;
+        }
+        uint32_t i = entity_index(p.entity);
+        if(e.type != EVENT_ROTATION){
+            entities.x[i] = e.move.x;
+            entities.y[i] = e.move.y;
+            entities.z[i] = e.move.z;
+        }
+        if(e.type != EVENT_POSITION){
+            entities.yaw[i] = e.move.yaw;
+            entities.pitch[i] = e.move.pitch;
+        }
+        if(e.on_ground){
+            entities.flags[i] |= ENTITY_ON_GROUND;
+        } else {
+            entities.flags[i] &= ~ENTITY_ON_GROUND;
+        }
+        int yaw_i = angle(entities.yaw[i]);
+        int pitch_i = angle(entities.pitch[i]);
+        if(e.type == EVENT_ROTATION){
+            broadcastPlayerRotation(yaw_i, pitch_i, e.on_ground, p.entity);
+        } else {
+            broadcastPlayerPosAndLook(entities.x[i], entities.y[i], entities.z[i], yaw_i, pitch_i, e.on_ground, p.entity);
+        }
+        break;
+    }
+    case EVENT_CHAT:
+        if(p.chat == "/stats"){
+            p.writeStats();
+        } else {
+            broadcastChatMessage(p.chat.c_str(), p.username.c_str());
+        }
+        k_sem_give(&p.chat_free);
+        break;
+    case EVENT_KEEPALIVE:
+        p.keepAlive(e.keepalive);
+        break;
+    case EVENT_ANIMATION:
+        broadcastEntityAnimation(e.value, p.entity);
+        break;
+    case EVENT_ACTION:
+        broadcastEntityAction(e.value, p.entity);
+        break;
+    case EVENT_TELEPORT_CONFIRM:
+        if(e.teleport == p.teleport){
+            p.teleport = 0;
+            p.moved_at = k_uptime_get();
+        }
+        break;
+    }
+}
+
+void minecraft::flush(){
+    for(auto &player : players){
+        if(!player.connected){
+            continue;
+        }
+        player.out.flush(player.S);
+        if(player.out.overflow){
+            player.kick("Connection too slow");
+        }
+    }
+}
+
+void minecraft::printPlayers(metrics_print_t print, void *ctx){
+    char line[96];
+    for(auto &player : players){
+        if(!player.connected){
+            continue;
+        }
+        snprintf(line, sizeof(line), "player %u %s rtt %u ms backlog %u B stalled %u ms (%u total, %u stalls)",
+                 player.id, player.username.c_str(), player.rtt, player.out.backlog(),
+                 player.out.stalled(), player.out.stall_ms, player.out.stalls);
+        print(ctx, line);
+        snprintf(line, sizeof(line), "player %u link %u B/s view %u", player.id, player.out.rate, player.view);
+        print(ctx, line);
+    }
+}
+
+// A slow link gets a shorter view distance, the client asks for less and
+// renders less. Changes by a single step are not worth a packet.
+void minecraft::player::adaptView(){
+    uint32_t distance = (uint64_t)out.rate * VIEW_DISTANCE / VIEW_FULL_RATE;
+    distance = CLAMP(distance, VIEW_DISTANCE_MIN, VIEW_DISTANCE);
+    if(distance == view || (distance + 1 == view && distance != VIEW_DISTANCE_MIN) ||
+       (distance == view + 1u && distance != VIEW_DISTANCE)){
+        return;
+    }
+    writeViewDistance(distance);
+}
+
+void minecraft::player::keepAlive(int64_t payload){
+    login("keepalive received: %lld", (long long)payload);
+    if(payload != keepalive_id || keepalive_id == 0){
+        return; // stale or made up, only the outstanding one is timed
+    }
+    updateRtt(k_uptime_get() - keepalive_sent);
+    keepalive_id = 0;
 }
 
 // CLIENTBOUND BROADCAST
-void minecraft::broadcastChatMessage(std::string msg, std::string username){
-    for(auto player : players){
+void minecraft::broadcastChatMessage(const char *msg, const char *username){
+    for(auto &player : players){
         if(player.connected){
             player.writeChat(msg, username);
         }
     }
 }
 
-void minecraft::broadcastSpawnPlayer(){
-    for(auto player : players){
-        if(player.connected){
-            for(auto p : players){
-                if(p.id != player.id && p.connected){
-                    player.writeSpawnPlayer(p.x, p.y, p.z, p.yaw_i, p.pitch_i, p.id);
-                    player.writeEntityLook(p.yaw_i, p.id);
-                }
-            }
+// the newcomer appears for everyone, everyone else for the newcomer only
+void minecraft::broadcastSpawnPlayer(player &joined){
+    uint32_t j = entity_index(joined.entity);
+    int joined_yaw_i = angle(entities.yaw[j]);
+    for(auto &p : players){
+        if(!p.connected || &p == &joined){
+            continue;
         }
+        uint32_t i = entity_index(p.entity);
+        int yaw_i = angle(entities.yaw[i]);
+        joined.writeSpawnPlayer(entities.x[i], entities.y[i], entities.z[i], yaw_i, angle(entities.pitch[i]), p.entity, p.id);
+        joined.writeEntityLook(yaw_i, p.entity);
+        p.writeSpawnPlayer(entities.x[j], entities.y[j], entities.z[j], joined_yaw_i, angle(entities.pitch[j]), joined.entity, joined.id);
+        p.writeEntityLook(joined_yaw_i, joined.entity);
     }
 }
 
-void minecraft::broadcastPlayerPosAndLook(double x, double y, double z, int _yaw_i, int _pitch_i, bool on_ground, uint8_t id){
-    for(auto player : players){
-        if(player.connected && player.id != id){
+void minecraft::broadcastPlayerPosAndLook(double x, double y, double z, int _yaw_i, int _pitch_i, bool on_ground, entity_id id){
+    for(auto &player : players){
+        if(player.connected && player.entity != id){
             player.writeEntityTeleport(x, y, z, _yaw_i, _pitch_i, on_ground, id);
             player.writeEntityLook(_yaw_i, id);
         }
     }
 }
 
-void minecraft::broadcastPlayerRotation(int _yaw_i, int _pitch_i, bool on_ground, uint8_t id){
-    for(auto player : players){
-        if(player.connected && player.id != id){
+void minecraft::broadcastPlayerRotation(int _yaw_i, int _pitch_i, bool on_ground, entity_id id){
+    for(auto &player : players){
+        if(player.connected && player.entity != id){
             player.writeEntityRotation(_yaw_i, _pitch_i, on_ground, id);
             player.writeEntityLook(_yaw_i, id);
         }
     }
 }
 
-void minecraft::broadcastEntityAnimation(uint8_t anim, uint8_t id){
-    for(auto player : players){
-        if(player.connected && player.id != id){
+void minecraft::broadcastEntityAnimation(uint8_t anim, entity_id id){
+    for(auto &player : players){
+        if(player.connected && player.entity != id){
             player.writeEntityAnimation(anim, id);
         }
     }
 }
 
-void minecraft::broadcastEntityAction(uint8_t action, uint8_t id){
-    for(auto player : players){
-        if(player.connected && player.id != id){
+void minecraft::broadcastEntityAction(uint8_t action, entity_id id){
+    for(auto &player : players){
+        if(player.connected && player.entity != id){
             player.writeEntityAction(action, id);
         }
     }
 }
 
-void minecraft::broadcastEntityDestroy(uint8_t id){
-    for(auto player : players){
-        if(player.connected && player.id != id){
+void minecraft::broadcastEntityDestroy(entity_id id){
+    for(auto &player : players){
+        if(player.connected && player.entity != id){
             player.writeEntityDestroy(id);
         }
     }
 }
 
-void minecraft::broadcastPlayerInfo(){
-    // calculate data length in a horrible non-automated way for now TODO
-    uint32_t num = getPlayerNum();
-    uint32_t len = 3 + (21 * num);
-    for(auto player : players){
+void minecraft::broadcastPlayerLatency(uint32_t ping, uint8_t id){
+    for(auto &player : players){
         if(player.connected){
-            len += player.username.length();
+            player.writePlayerLatency(ping, id);
+        }
+    }
+}
+
+// the newcomer is added to every list, only the newcomer gets the whole list
+void minecraft::broadcastPlayerInfo(player &joined){
+    for(auto &player : players){
+        if(player.connected && &player != &joined){
+            player.writePlayerInfo(&joined);
         }
     }
-    // broadcast playerinfo
-    for(auto player : players){
+    joined.writePlayerInfo(NULL);
+    joined.login("player info sent");
+}
+
+void minecraft::broadcastPlayerRemove(uint8_t id){
+    for(auto &player : players){
         if(player.connected){
-            packet pac(player.S, player.mtx);
-            pac.writeVarInt(0x32);
-            pac.writeVarInt(0); // action add player
-            pac.writeVarInt(num); // number of players
-            for(auto p : players){
-                if(p.connected){
-                    pac.writeUUID(p.id); // first player's uuid
-                    pac.writeString(p.username);
-                    pac.writeVarInt(0); // no properties given
-                    pac.writeVarInt(1); // gamemode
-                    pac.writeVarInt(100); // hardcoded ping TODO
-                    pac.writeBoolean(0); // has display name
-                }
-            }
-            pac.writePacket();
-            player.login("player info sent");
+            player.writePlayerRemove(id);
         }
     }
 }
 
 uint8_t minecraft::getPlayerNum(){
     uint8_t i = 0;
-    for(auto player : players){
+    for(auto &player : players){
         if(player.connected) i++;
     }
     return i;
 }
 
+#define CHUNK_SECTION_SIZE (2 + 1 + 2 + sizeof(palette) + 2 + SECTION_BLOCKS)
+#define CHUNK_SEGMENTS (6 + 4 * CHUNK_SECTIONS)
+#define JOIN_SEGMENTS (BUNDLE_SEGMENTS + WORLD_CHUNKS * WORLD_CHUNKS * CHUNK_SEGMENTS)
+
+// staged bytes of one Chunk Data frame, its segments point in here
+struct chunk_frame {
+    uint8_t head[32];
+    uint8_t data_size[5];
+    uint8_t counts[CHUNK_SECTIONS][5];
+};
+
+static int frameChunk(world &map, uint8_t cx, uint8_t cz, chunk_frame &f, struct iovec *iov,
+                      uint32_t *length, size_t *framed);
+
+// JOIN BUNDLE
+// Everything a player receives between Login Success and the chunks,
+// framed once at boot. Only the entity id and the spawn position differ
+// between players, they are patched into a copy of the staged bytes.
+static bundle join_bundle;
+static int32_t join_entity_at = -1;
+static int32_t join_position_at = -1;
+
+static void putJoinGame(packet &p){
+    p.writeVarInt(0x24);
+    p.writeInt(0); // entity id, patched per player
+    p.writeBoolean(0); // is hardcore
+    p.writeUnsignedByte(1); // gamemode
+    p.writeByte(-1); // previous gamemode
+    p.writeVarInt(1); // only one world
+    p.writeString("minecraft:overworld"); // only one world
+    p.reference(dimension_codec_NBT, sizeof(dimension_codec_NBT)); // NBT with world settings
+    p.reference(dimension_NBT, sizeof(dimension_NBT)); // NBT with world settings
+    p.writeString("minecraft:overworld"); // spawn world
+    p.writeLong(0); // hashed seed
+    p.writeVarInt(10); // max players
+    p.writeVarInt(VIEW_DISTANCE); // view distance
+    p.writeBoolean(0); // reduced debug info
+    p.writeBoolean(0); // enable respawn screen
+    p.writeBoolean(0); // is debug world
+    p.writeBoolean(1); // is flat
+}
+
+void minecraft::buildJoinBundle(){
+    packet join(-1, NULL, NULL);
+    putJoinGame(join);
+    join_entity_at = join_bundle.add(join) + 1;
+
+    packet look(-1, NULL, NULL);
+    look.writeVarInt(0x34);
+    look.writeDouble(0); // x, y and z are patched per player
+    look.writeDouble(0);
+    look.writeDouble(0);
+    look.writeFloat(0);
+    look.writeFloat(0);
+    look.writeUnsignedByte(0x00);
+    look.writeVarInt(TELEPORT_JOIN);
+    join_position_at = join_bundle.add(look) + 1;
+
+    packet difficulty(-1, NULL, NULL);
+    difficulty.writeVarInt(0x0D);
+    difficulty.writeUnsignedByte(0);
+    difficulty.writeBoolean(1);
+    join_bundle.add(difficulty);
+    __ASSERT(join_entity_at > 0 && join_position_at > 0, "join bundle too small");
+}
+
+void minecraft::player::writeJoinBundle(){
+    uint8_t staged[BUNDLE_BUFFER_SIZE];
+    memcpy(staged, join_bundle.buffer, join_bundle.index);
+    uint32_t i = entity_index(entity);
+    sys_put_be32(entity, staged + join_entity_at);
+    double pos[3] = {mc->entities.x[i], mc->entities.y[i], mc->entities.z[i]};
+    for(int i = 0; i < 3; i++){
+        uint64_t bits;
+        memcpy(&bits, &pos[i], sizeof(bits));
+        sys_put_be64(bits, staged + join_position_at + i * 8);
+    }
+    struct iovec iov[JOIN_SEGMENTS];
+    join_bundle.prepare(iov, staged);
+
+    // the chunks go in the same write, behind the bundle's frames
+    world &map = mc->map;
+    chunk_frame frames[WORLD_CHUNKS * WORLD_CHUNKS];
+    uint32_t lengths[WORLD_CHUNKS * WORLD_CHUNKS];
+    int n = join_bundle.nsegments;
+    size_t total = 0;
+    map.hold(); // sections stay put until sent
+    for(uint8_t c = 0; c < WORLD_CHUNKS * WORLD_CHUNKS; c++){
+        n += frameChunk(map, c / WORLD_CHUNKS, c % WORLD_CHUNKS, frames[c], iov + n, &lengths[c], &total);
+    }
+    join_bundle.writeBundle(S, &mtx, &out, iov, n, total);
+    map.release();
+    for(uint8_t c = 0; c < WORLD_CHUNKS * WORLD_CHUNKS; c++){
+        packet_traffic.count(METRICS_OUT, 0x20, lengths[c]);
+    }
+    logout("join bundle sent");
+}
+
+// CHUNKS
+// Chunk Data of one column with only the sections that hold blocks, the
+// primary bitmask and the data size follow from them. Per section only the
+// block count is staged, the palette and the blocks go out from where they
+// are. The caller holds the world until the frame is sent.
+static const uint8_t biomes_length[] = {0x80, 0x08};   // VarInt 1024
+static const uint8_t section_longs[] = {0x80, 0x04};   // VarInt 512, 8 bits per block
+static const uint8_t no_block_entities[] = {0x00};
+
+static size_t putVarInt(uint8_t *buf, uint32_t value){
+    size_t n = 0;
+    do {
+        uint8_t temp = (uint8_t)(value & 0b01111111);
+        value >>= 7;
+        if (value != 0) {
+            temp |= 0b10000000;
+        }
+        buf[n++] = temp;
+    } while (value != 0);
+    return n;
+}
+
+static int frameChunk(world &map, uint8_t cx, uint8_t cz, chunk_frame &f, struct iovec *iov,
+                      uint32_t *length, size_t *framed){
+    int n = 0;
+    uint16_t mask = map.sectionMask(cx, cz);
+    uint32_t sections = __builtin_popcount(mask);
+
+    // the payload first, its length goes in front
+    uint8_t *p = f.head + 5;
+    p += putVarInt(p, 0x20);
+    sys_put_be32(cx, p);
+    sys_put_be32(cz, p + 4);
+    p += 8;
+    *p++ = 1; // full chunk
+    p += putVarInt(p, mask);
+    size_t fixed = p - (f.head + 5);
+    size_t data = sections * CHUNK_SECTION_SIZE;
+    size_t data_bytes = putVarInt(f.data_size, data);
+    *length = fixed + sizeof(height_map_NBT) + sizeof(biomes_length) + sizeof(void_biomes) +
+              data_bytes + data + sizeof(no_block_entities);
+    uint8_t prefix[5];
+    size_t plen = putVarInt(prefix, *length);
+    memcpy(f.head + 5 - plen, prefix, plen);
+    iov[n++] = {f.head + 5 - plen, plen + fixed};
+    iov[n++] = {(void *)height_map_NBT, sizeof(height_map_NBT)};
+    iov[n++] = {(void *)biomes_length, sizeof(biomes_length)};
+    iov[n++] = {(void *)void_biomes, sizeof(void_biomes)};
+    iov[n++] = {f.data_size, data_bytes};
+
+    for(uint8_t y = 0; y < CHUNK_SECTIONS; y++){
+        const uint8_t *blocks = map.section(cx, cz, y);
+        if(!(mask & BIT(y)) || !blocks){
+            continue;
+        }
+        uint8_t *c = f.counts[y];
+        sys_put_be16(map.blockCount(cx, cz, y), c);
+        c[2] = 8; // bits per block
+        c[3] = 0x80; // VarInt 256 palette entries
+        c[4] = 0x02;
+        iov[n++] = {c, 5};
+        iov[n++] = {(void *)palette, sizeof(palette)};
+        iov[n++] = {(void *)section_longs, sizeof(section_longs)};
+        iov[n++] = {(void *)blocks, SECTION_BLOCKS};
+    }
+    iov[n++] = {(void *)no_block_entities, sizeof(no_block_entities)};
+    *framed += plen + *length;
+    return n;
+}
+
 // CLIENTBOUND PLAYER
-void minecraft::player::writeChat(std::string msg, std::string username){
-    packet p(S, mtx);
-    std::string s = "{\"text\": \"<" + username + "> " + msg + "\",\"bold\": \"false\"}";
+void minecraft::player::writeChat(const char *msg, const char *username){
+    packet p(S, &mtx, &out);
     p.writeVarInt(0x0E);
-    p.writeString(s);
+    json_text(p).raw("{\"text\":\"<").escaped(username).raw("> ").escaped(msg).raw("\",\"bold\":false}").end();
     p.writeByte(0);
     p.writeUUID(id);
     p.writePacket();
 }
 
+void minecraft::player::writeLoginDisconnect(const char *reason){
+    packet p(S, &mtx, &out);
+    p.writeVarInt(0x00); // packet id in the login state
+    json_text(p).raw("{\"text\":\"").escaped(reason).raw("\"}").end();
+    p.writePacket();
+    logout("login disconnect sent: %s", reason);
+}
+
 void minecraft::player::writeLoginSuccess(){
-    packet p(S, mtx);
+    packet p(S, &mtx, &out);
     p.writeVarInt(0x02);
     p.writeUUID(id);
-    p.writeString(username);
+    p.writeString(username.c_str(), username.length());
     p.writePacket();
     logout("login success sent");
 }
 
-void minecraft::player::writeChunk(uint8_t x, uint8_t y){
-    packet p(S, mtx);
-    p.writeVarInt(0x20); 
-    p.writeInt(x); // X
-    p.writeInt(y); // Z
-    p.writeBoolean(1); // full chunk yes
-    p.writeVarInt(0x01); //bitmask set to 0xFF because we're sending the whole chunk
-
-    p.write(height_map_NBT, sizeof(height_map_NBT) / sizeof(height_map_NBT[0]));
-
-    uint8_t b[1024];
-    memset(b, 127, 1024);
-    p.writeVarInt(1024); // array length 2 bytes as varint
-    p.write(b, 1024); // 127 = void biome
-    
-    p.writeVarInt(4487); // magic 
-
-    p.writeShort(1); // non-air blocks (can't be bothered calculating it and the client doesn't need it)
-    p.writeUnsignedByte(8); // bits per block
-    p.writeVarInt(256); // palette length 8 bits per block
-    p.write(palette, 384); // write palette
-    p.writeVarInt(512); // we're sending 512 longs or 4096 bytes
-    uint8_t * buf = (uint8_t*)chunk[x][y];
-    p.write(buf, 4096);
-
-    p.writeVarInt(0); // no block entities
-    p.writePacket();
-    logout("chunk sent");
-}
-
-void minecraft::player::writePlayerPositionAndLook(double x, double y, double z, float _yaw, float _pitch, uint8_t flags){
-    packet p(S, mtx);
+void minecraft::player::writePlayerPositionAndLook(double x, double y, double z, float _yaw, float _pitch, uint8_t flags, int32_t teleport){
+    packet p(S, &mtx, &out);
     p.writeVarInt(0x34);
     p.writeDouble(x);
     p.writeDouble(y);
@@ -309,85 +856,57 @@ void minecraft::player::writePlayerPositionAndLook(double x, double y, double z,
     p.writeFloat(_yaw);
     p.writeFloat(_pitch);
     p.writeUnsignedByte(flags);
-    p.writeVarInt(0x55);
+    p.writeVarInt(teleport);
     p.writePacket();
     logout("player position and look sent");
 }
 
 void minecraft::player::writeKeepAlive(){
-    packet p(S, mtx);
+    packet p(S, &mtx, &out);
     p.writeVarInt(0x1F);
-    uint32_t num = k_uptime_get() / 1000;
-    p.writeLong(num);
-    logout("keepalive sent: " + std::to_string(num));
+    keepalive_sent = k_uptime_get();
+    keepalive_id = keepalive_sent; // send time doubles as the id, never 0
+    p.writeLong(keepalive_id);
+    logout("keepalive sent: %lld", (long long)keepalive_id);
     p.writePacket();
 }
 
-void minecraft::player::writeServerDifficulty(){
-    packet p(S, mtx);
-    p.writeVarInt(0x0D);
-    p.writeUnsignedByte(0);
-    p.writeBoolean(1);
-    logout("server difficulty packet sent");
-    p.writePacket();
-}
-
-void minecraft::player::writeSpawnPlayer(double x, double y, double z, int _yaw_i, int _pitch_i, uint8_t id){
-    packet p(S, mtx);
+void minecraft::player::writeSpawnPlayer(double x, double y, double z, int _yaw_i, int _pitch_i, entity_id id, uint8_t uuid){
+    packet p(S, &mtx, &out);
     p.writeVarInt(0x04);
-    p.writeVarInt(id); // player id
-    p.writeUUID(id); // player uuid
+    p.writeVarInt(id); // entity id
+    p.writeUUID(uuid); // player uuid
     p.writeDouble(x); // player x
     p.writeDouble(y); // player y
     p.writeDouble(z); // player z
     p.writeUnsignedByte(_yaw_i); // player yaw
     p.writeUnsignedByte(_pitch_i); // player pitch
     p.writePacket();
-    logout("spawn player sent id:" + std::to_string(id));
-}
-
-void minecraft::player::writeJoinGame(){
-    packet p(S, mtx);
-    p.writeVarInt(0x24);
-    p.writeInt(id); // entity id
-    p.writeBoolean(0); // is hardcore
-    p.writeUnsignedByte(1); // gamemode
-    p.writeByte(-1); // previous gamemode
-    p.writeVarInt(1); // only one world
-    p.writeString("minecraft:overworld"); // only one world
-    p.write(dimension_codec_NBT, sizeof(dimension_codec_NBT) / sizeof(dimension_codec_NBT[0])); // NBT with world settings
-    p.write(dimension_NBT, sizeof(dimension_NBT) / sizeof(dimension_NBT[0])); // NBT with world settings
-    p.writeString("minecraft:overworld"); // spawn world
-    p.writeLong(0); // hashed seed
-    p.writeVarInt(10); // max players
-    p.writeVarInt(12); // view distance
-    p.writeBoolean(0); // reduced debug info
-    p.writeBoolean(0); // enable respawn screen
-    p.writeBoolean(0); // is debug world
-    p.writeBoolean(1); // is flat
-    logout("join game packet sent");
-    p.writePacket();
+    logout("spawn player sent id: %u", id);
 }
 
-void minecraft::player::writeResponse(){
-    packet p(S, mtx);
-    p.writeVarInt(0);
-    // In the below line, if there is an error from the favicon being too large in size, consider compressing it or increasing "buffer" from 6000 in minecraft.h.
-    p.writeString("{\"version\": {\"name\": \"1.16.5\",\"protocol\": 754},\"players\": {\"max\": 5,\"online\": 5,\"sample\": [{\"name\": \"L_S___S_S_S__S_L\",\"id\": \"00000000-0000-0000-0000-000000000000\"},{\"name\": \"L_SS__S_S_S_S__L\",\"id\": \"00000000-0000-0000-0000-000000000001\"},{\"name\": \"L_S_S_S_S_SS___L\",\"id\": \"00000000-0000-0000-0000-000000000002\"},{\"name\": \"L_S__SS_S_S_S__L\",\"id\": \"00000000-0000-0000-0000-000000000003\"},{\"name\": \"L_S___S_S_S__S_L\",\"id\": \"00000000-0000-0000-0000-000000000004\"}]},\"description\": {\"text\": \"A Minecraft server running on an ESP32!\"},\"favicon\":\"data:image/png;base64,iVBORw0KGgoAAAANSUhEUgAAAEAAAABACAMAAACdt4HsAAABU1BMVEUAAAAWMxcBAwELHwwBBAECCgMMIQ0AAgABAgEBBgEBBAEBBQEAAwECCAIDEAQDDgQDDgQDDAQLIAsQKhIZPRsBCAEBBgEDDgMIGwgGFgcKHwsUMhQDDwMGFwYCCAICCQIGFgcCCQMIHAkEEAQLIwwFEwUKHAoDDAMBAwEDDgMCCQIFEwUCCgIIHAkCCgIDCgMMJA0IGgkRLBISLBIEEQQBBQEBBgEDEAMEEAQBBAEFEwUDCwMHGggIGwgCCgMIGwgDDARMr1AAAAABBAFLrk9FoUlJqU1Bl0QjWiYHHAdKqk5Goko5hjw2gTkfTyEVOxYLJwwCDAI1fjg0fDcRMhIOLA9HpUtEnkgzejYtbzAsay4oYysmXyglXSchVSM/lUM6iD0SNhQPLxEIIAkFGAZEn0hDnUcqZywUOBYDEgQ3gjo/k0I+kUE8jkAxdTQbRhwaRhyU8jDPAAAAQXRSTlMABPsT0YwI9/Tr4LTw2tOHZVomEQf0y8ZoQjwN3a+vkYp6dm9dUyH65uW4tpeRc2hVKh4ZzMe+pKCYlSq8u6h/XiA2BHYAAAPMSURBVFjDzZdZVxNBEIU7Y0ICCRokgIiAiOACCIr7Pt+EhCxkIQlLgLAruP//JzM4xMx0JRLP8Rzv43RVddXtqtvT6l/D5/tbz+m+QNh/1wCj2x8O9F3tzHt4vAcPemaHL5rMpQnH28rXdra2dmp5y4kxceki7oEQQLm6tx43HaTX96plgFDgTyF8DyLA4WYybnoQT24eApHJtoW8GgTKKwlTRGKlDAw+bO0/H4RUKW22RLqUgmC0VfovgOWM2RaZZWBWLKMrDKcr5h/x6RTCXYL/U6gkzQsgWYGnWgRfGPJL5oWwlIewt4oXkJfKl4nIw6zbPwoVeX85hwpEXecf5DRpdoDkKcGHTQQMworZEVZg8DcNk7BsdohlmGzMT4RUptMAmRSR88kKQMnsGCW46SQQopzuPEC6zMCvFCbaMZhItOPxlrLRw6FsdbyRO4RUbuNYjn3IjTP9g02xWbZpYFtssk24Xg8wDlIPZY+AgaFnz4ZCQCordRPMnVVQieuLG8DjhdjZnE4NAhu6TfzArmEaPupre2DcUg1MGrCnW32ER6oPslKXGAuqCVMGqSVpmwUVgA/aypZ9Qi48gC3N7IPdS2FIawcAl30ewfFjaSmkYVT5OdEir8Jt5UEfrGqGeS6ru+SESbszojwYCQoTm+OeMoTv5XpgDX72pZ0UbGvfLd4oDfexNMNtLDkAry8eQCrtRC7hRCpBJHEHo9/r32+wI5LoJ6/fXnBNeRCFT0KqfjUmNNJakRsxt3+sl+Ka0Ehj6orUylW7R12om1WlVr6ipqRhWitguYqIWhTWdM2AKfVIHOcvFgS6Gjd3wML60mKcVa8oKFkLLscag4QlSFK8Qq99K8iS9hWMRUf3DfgqmOxCoL58HaqyaD9XDp7Lwl89E1W7hlRConFgUTlYDEkUJlLcOBebVUmy36kGJiTpXz2Xrf4IB94Ujovca5KErh6K694EDoj0N5pkQ5sGbnv0aEcX/ivnc9LNkVvvPsNj5cIT+OzWzSO6GxM3D7V48wF/t/l14brFD5dJrXngfE/cPGZttfXgLWTdDA41CffVEMXdZnqC09oLJthM9W6RAdcj5j0UGjR/02bRofpb45AKmvCPw75DZKZOz4jSMFKnOuMQuA9znmXfGOz/ymHLpkdA9Px2W9+HUZ/2s30fCjYPSf1e+z2USbv+AszEhN/1MSiW4vEcDCsRw5CLx1eLMBoTdxgHaiWYUS0wA6UaMOdTMvpCAEbLR9FVA2DA4V+0GAJetl5/CQy1f8TOd/deavOo7O2+5lP/GX4CF6CJedzJaM4AAAAASUVORK5CYII=\"}");
-    logout("response packet sent");
-    p.writePacket();
-}
-
-void minecraft::player::writePong(uint64_t payload){
-    packet p(S, mtx);
-    p.writeVarInt(0x01); // packet id
-    p.writeLong(payload); // payload
-    logout("pong");
+void minecraft::player::writeSpawnMob(entity_id id){
+    entity_store &es = mc->entities;
+    uint32_t i = entity_index(id);
+    packet p(S, &mtx, &out);
+    p.writeVarInt(0x02);
+    p.writeVarInt(id); // entity id
+    p.writeEntityUUID(id);
+    p.writeVarInt(es.owner[i]); // mob type
+    p.writeDouble(es.x[i]);
+    p.writeDouble(es.y[i]);
+    p.writeDouble(es.z[i]);
+    p.writeUnsignedByte(angle(es.yaw[i])); // yaw
+    p.writeUnsignedByte(angle(es.pitch[i])); // pitch
+    p.writeUnsignedByte(angle(es.yaw[i])); // head yaw
+    p.writeShort(es.vx[i] * 8000); // velocity in 1/8000 blocks per tick
+    p.writeShort(es.vy[i] * 8000);
+    p.writeShort(es.vz[i] * 8000);
     p.writePacket();
 }
 
-void minecraft::player::writeEntityTeleport(double x, double y, double z, int _yaw_i, int _pitch_i, bool on_ground, uint8_t id){
-    packet p(S, mtx);
+void minecraft::player::writeEntityTeleport(double x, double y, double z, int _yaw_i, int _pitch_i, bool on_ground, entity_id id){
+    packet p(S, &mtx, &out);
     p.writeVarInt(0x56); // packet id
     p.writeVarInt(id);
     p.writeDouble(x);
@@ -396,29 +915,29 @@ void minecraft::player::writeEntityTeleport(double x, double y, double z, int _y
     p.writeByte(_yaw_i);
     p.writeByte(_pitch_i);
     p.writeBoolean(on_ground);
-    p.writePacket();
+    p.writePacket(OUTBOX_STATE(0x56, id));
 }
 
-void minecraft::player::writeEntityRotation(int _yaw_i, int _pitch_i, bool on_ground, uint8_t id){
-    packet p(S, mtx);
+void minecraft::player::writeEntityRotation(int _yaw_i, int _pitch_i, bool on_ground, entity_id id){
+    packet p(S, &mtx, &out);
     p.writeVarInt(0x29); // packet id
     p.writeVarInt(id);
     p.writeByte(_yaw_i);
     p.writeByte(_pitch_i);
     p.writeBoolean(on_ground);
-    p.writePacket();
+    p.writePacket(OUTBOX_STATE(0x29, id));
 }
 
-void minecraft::player::writeEntityLook(int _yaw_i, uint8_t id){
-    packet p(S, mtx);
+void minecraft::player::writeEntityLook(int _yaw_i, entity_id id){
+    packet p(S, &mtx, &out);
     p.writeVarInt(0x3A); // packet id
     p.writeVarInt(id);
     p.writeByte(_yaw_i);
-    p.writePacket();
+    p.writePacket(OUTBOX_STATE(0x3A, id));
 }
 
-void minecraft::player::writeEntityAnimation(uint8_t anim, uint8_t id){
-    packet p(S, mtx);
+void minecraft::player::writeEntityAnimation(uint8_t anim, entity_id id){
+    packet p(S, &mtx, &out);
     p.writeVarInt(0x05); // packet id
     p.writeVarInt(id);
     switch(anim){
@@ -432,8 +951,8 @@ void minecraft::player::writeEntityAnimation(uint8_t anim, uint8_t id){
     p.writePacket();
 }
 
-void minecraft::player::writeEntityAction(uint8_t action, uint8_t id){
-    packet p(S, mtx);
+void minecraft::player::writeEntityAction(uint8_t action, entity_id id){
+    packet p(S, &mtx, &out);
     p.writeVarInt(0x44); // packet id
     p.writeVarInt(id);
     switch(action){
@@ -452,19 +971,113 @@ void minecraft::player::writeEntityAction(uint8_t action, uint8_t id){
     p.writePacket();
 }
 
-void minecraft::player::writeEntityDestroy(uint8_t id){
-    packet p(S, mtx);
+void minecraft::player::writeEntityDestroy(entity_id id){
+    packet p(S, &mtx, &out);
     p.writeVarInt(0x36); // packet id
     p.writeVarInt(1); // entity count
     p.writeVarInt(id);
     p.writePacket();
 }
 
+void minecraft::player::writePlayerLatency(uint32_t ping, uint8_t id){
+    packet p(S, &mtx, &out);
+    p.writeVarInt(0x32); // packet id
+    p.writeVarInt(2); // action update latency
+    p.writeVarInt(1); // number of players
+    p.writeUUID(id);
+    p.writeVarInt(ping);
+    p.writePacket();
+}
+
+// Player Info add, for one player or all connected ones when only is NULL
+void minecraft::player::writePlayerInfo(const player *only){
+    packet p(S, &mtx, &out);
+    p.writeVarInt(0x32); // packet id
+    p.writeVarInt(0); // action add player
+    p.writeVarInt(only ? 1 : mc->getPlayerNum()); // number of players
+    for(auto &q : mc->players){
+        if(!q.connected || (only && &q != only)){
+            continue;
+        }
+        p.writeUUID(q.id);
+        p.writeString(q.username.c_str(), q.username.length());
+        p.writeVarInt(0); // no properties given
+        p.writeVarInt(1); // gamemode
+        p.writeVarInt(q.rtt); // ping
+        p.writeBoolean(0); // has display name
+    }
+    p.writePacket();
+}
+
+void minecraft::player::writePlayerRemove(uint8_t id){
+    packet p(S, &mtx, &out);
+    p.writeVarInt(0x32); // packet id
+    p.writeVarInt(4); // action remove player
+    p.writeVarInt(1); // number of players
+    p.writeUUID(id);
+    p.writePacket();
+}
+
+void minecraft::player::writeViewDistance(uint8_t distance){
+    packet p(S, &mtx, &out);
+    p.writeVarInt(0x41); // packet id
+    p.writeVarInt(distance);
+    p.writePacket();
+    view = distance;
+}
+
+void minecraft::player::writeDisconnect(const char *reason){
+    packet p(S, &mtx, &out);
+    p.writeVarInt(0x19); // packet id
+    json_text(p).raw("{\"text\":\"").escaped(reason).raw("\"}").end();
+    p.writePacket();
+    logout("disconnect sent: %s", reason);
+}
+
+static void chatPrint(void *ctx, const char *line){
+    minecraft::player *p = (minecraft::player *)ctx;
+    p->writeChat(line, "Server");
+}
+
+void minecraft::player::writeStats(){
+    char line[48];
+    snprintf(line, sizeof(line), "players %u/%u", mc->getPlayerNum(),
+             (unsigned)(sizeof(mc->players) / sizeof(mc->players[0])));
+    writeChat(line, "Server");
+    snprintf(line, sizeof(line), "you: rtt %u ms, stalled %u ms", rtt, out.stall_ms + out.stalled());
+    writeChat(line, "Server");
+    snprintf(line, sizeof(line), "you: link %u B/s, view %u", out.rate, view);
+    writeChat(line, "Server");
+    metrics_summary(chatPrint, this);
+}
+
 // READ TYPES
+// The readers decode the payload of the frame being dispatched. Reading
+// past its end yields zeros and marks the frame malformed, the next frame
+// is unaffected.
+bool minecraft::player::receive(void *buf, size_t size){
+    uint32_t n = MIN((uint32_t)size, in_left);
+    memcpy(buf, in, n);
+    in += n;
+    in_left -= n;
+    if(n < size){
+        memset((uint8_t *)buf + n, 0, size - n);
+        overrun = true;
+        return false;
+    }
+    return true;
+}
+
+void minecraft::player::skip(uint32_t size){
+    uint32_t n = MIN(size, in_left);
+    in += n;
+    in_left -= n;
+}
+
 uint16_t minecraft::player::readUnsignedShort(){
 	uint8_t r[sizeof(uint16_t)] = {0};
 
-	recv(S, r, sizeof(uint16_t), 0);
+	receive(r, sizeof(uint16_t));
 
 	return sys_get_be16(r);
 }
@@ -472,43 +1085,50 @@ uint16_t minecraft::player::readUnsignedShort(){
 float minecraft::player::readFloat(){
     uint8_t r[sizeof(float)] = {0};
 
-	recv(S, r, sizeof(float), 0);
+	receive(r, sizeof(float));
 
-    return (float)(sys_get_be32(r));
+    uint32_t bits = sys_get_be32(r);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
 }
 
 double minecraft::player::readDouble(){
     uint8_t r[sizeof(double)] = {0};
 
-	recv(S, r, sizeof(double), 0);
-
-    return (double)(sys_get_be64(r));
-}
-
-uint32_t minecraft::player::readUnsignedLong(){
-    uint8_t r[sizeof(uint32_t)] = {0};
-
-	recv(S, r, sizeof(uint32_t), 0);
+	receive(r, sizeof(double));
 
-    return (int32_t)(sys_get_be32(r));
+    uint64_t bits = sys_get_be64(r);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
 }
 
 int64_t minecraft::player::readLong(){
     uint8_t r[sizeof(int64_t)] = {0};
 
-	recv(S, r, sizeof(int64_t), 0);
+	receive(r, sizeof(int64_t));
 
     return (int64_t)(sys_get_be64(r));
 }
 
-std::string minecraft::player::readString(){
-    int length = readVarInt();
-
-    std::string result(length + 1, 0);
-
-	recv(S, &result[0], length, 0);
-
-    return result;
+uint16_t minecraft::player::readString(char *dst, size_t size){
+    int32_t length = readVarInt();
+    if(length < 0){
+        length = 0;
+    }
+    uint32_t keep = MIN((uint32_t)length, size);
+	receive(dst, keep);
+
+    // drop the rest, the cut goes before a partial character
+    if((uint32_t)length > keep){
+        uint8_t next = readByte();
+        skip(length - keep - 1);
+        while(keep > 0 && (next & 0xC0) == 0x80){
+            next = dst[--keep];
+        }
+    }
+    return keep;
 }
 
 int32_t minecraft::player::readVarInt() {
@@ -517,7 +1137,9 @@ int32_t minecraft::player::readVarInt() {
     uint8_t current_byte;
 
     do {
-        recv(S, &current_byte, 1, 0);
+        if(!receive(&current_byte, 1)){
+            return 0;
+        }
 
         int32_t value_segment = (current_byte & 0b01111111);
         result |= (value_segment << (7 * numRead));
@@ -532,17 +1154,17 @@ int32_t minecraft::player::readVarInt() {
 }
 
 uint8_t minecraft::player::readByte(){
-	uint8_t r;
+	uint8_t r = 0;
 
-	recv(S, &r, sizeof(uint8_t), 0);
+	receive(&r, sizeof(uint8_t));
 
     return r;
 }
 
 bool minecraft::player::readBool(){
-	uint8_t r;
+	uint8_t r = 0;
 
-	recv(S, &r, sizeof(uint8_t), 0);
+	receive(&r, sizeof(uint8_t));
 
 	return (bool)r;
 }
@@ -584,15 +1206,13 @@ void packet::writeVarLong(int64_t value) {
     } while (value != 0);
 }
 
-void packet::writeString(std::string str){
-    int length = str.length();
-    uint8_t buf[length + 1]; 
-	memcpy(buf, str.data(), length);
-    writeVarInt(length);
-    write(buf, length);
-    /*for(int i=0; i<length; i++){
-        write(buf[i]);
-    }*/
+void packet::writeString(const char *str, size_t size){
+    writeVarInt(size);
+    write((const uint8_t *)str, size);
+}
+
+void packet::writeString(const char *str){
+    writeString(str, strlen(str));
 }
 
 void packet::writeLong(int64_t num){
@@ -642,117 +1262,310 @@ void packet::writeUUID(int user_id){
     write(user_id);
 }
 
-void minecraft::player::writeLength(uint32_t length){
-    do {
-        uint8_t temp = (uint8_t)(length & 0b01111111);
-        length = lsr(length,7);
-        if (length != 0) {
-            temp |= 0b10000000;
-        }
-		send(S, &temp, sizeof(temp), 0);
-    } while (length != 0);
+// non player entities, kept apart from the player uuids above
+void packet::writeEntityUUID(entity_id id){
+    uint8_t b[11] = {0};
+    write(b, 11);
+    write(0x01);
+    writeInt(id);
 }
 
 // HANDLERS
 bool minecraft::player::join(){
-    uint8_t res = readHandShake();
-    if(res == 1){
-        readRequest();
-        k_msleep(1000);
-        writeResponse();
-        uint64_t payload = readPing();
-        writePong(payload);
+    closed = false;
+    state = STATE_LOGIN;
+    decoder.reset();
+    if(!out.open()){
+        logerr("network pool spent");
+        writeLoginDisconnect("Server out of memory"); // still blocking, no queue needed
+        closed = true;
         return false;
-    } else if(res == 2){
-        if(!readLoginStart()) return false;
-        writeLoginSuccess();
     }
-    connected = true;
-    writeJoinGame();
-    writePlayerPositionAndLook(0, 5, 0, 0, 0, 0x00);
-    writeServerDifficulty();
-    writeChunk(0, 0);
-    writeChunk(0, 1);
-    writeChunk(1, 0);
-    writeChunk(1, 1);
-    mc->broadcastPlayerInfo();
-    mc->broadcastChatMessage(username + " joined the server", "Server");
-    mc->broadcastSpawnPlayer();
+    double x = 0, z = 0;
+    if(SHARDS > 1){
+        uint8_t cx, cz;
+        shard_spawn(username.c_str(), username.length(), &cx, &cz);
+        x = cx * 16 + 8;
+        z = cz * 16 + 8;
+    }
+    entity = mc->entities.create(ENTITY_PLAYER, id, x, 5, z);
+    if(entity == ENTITY_NONE){
+        logerr("entity store full");
+        writeLoginDisconnect("Server full");
+        closed = true;
+        return false;
+    }
+    writeLoginSuccess();
+    state = STATE_PLAY;
+    writeJoinBundle();
+    out.blocking = false; // from here on the game thread writes, never blocking
+    post({EVENT_JOIN, id}); // the game thread announces us from here on
     return true;
 }
 
+void minecraft::player::enter(){
+    keepalive_id = 0;
+    keepalive_sent = k_uptime_get();
+    rtt = 0;
+    rtt_reported = 0;
+    teleport = TELEPORT_JOIN; // the client confirms the join position first
+    teleport_next = TELEPORT_JOIN;
+    view = VIEW_DISTANCE;
+    moved_at = k_uptime_get();
+    connected = true;
+    mc->updateStatus();
+    mc->broadcastPlayerInfo(*this);
+    char line[48];
+    snprintf(line, sizeof(line), "%s joined the server", username.c_str());
+    mc->broadcastChatMessage(line, "Server");
+    mc->broadcastSpawnPlayer(*this);
+    for(uint32_t i = 0; i < mc->entities.end(); i++){
+        if(mc->entities.kind[i] == ENTITY_MOB){
+            writeSpawnMob(mc->entities.id(i));
+        }
+    }
+    writeMirrors();
+}
+
 void minecraft::handle(){
-    for(auto player : players){
-        if(player.connected){
+    int64_t now = k_uptime_get();
+    for(auto &player : players){
+        if(!player.connected){
+            continue;
+        }
+        if(player.keepalive_id != 0){
+            if(now - player.keepalive_sent > KEEPALIVE_TIMEOUT_MS){
+                disconnects_timeout.inc();
+                player.kick("Timed out");
+            }
+        } else if(now - player.keepalive_sent >= KEEPALIVE_INTERVAL_MS){
             player.writeKeepAlive();
         }
+        player.out.tick(TICK_MS, player.rtt);
+        if(tick % VIEW_UPDATE_TICKS == 0){
+            player.adaptView();
+        }
+    }
+    updateMobs();
+    updateShard();
+}
+void minecraft::updateMobs(){
+    if(getPlayerNum() == 0){
+        return; // nobody to see them, the world stands still
+    }
+    uint32_t start = k_cycle_get_32();
+    uint32_t moved = mobs.tick(CONFIG_MC_MOB_TICK_BUDGET_US);
+    mobs_deferred.add(mobs.count() - MIN(moved, mobs.count()));
+    if(mobs.count() < CONFIG_MC_MOBS){
+        mobs.spawnRandom(); // one per tick keeps the spawn burst small
+    }
+    mob_tick.record(k_cyc_to_us_floor32(k_cycle_get_32() - start));
+    mob_count.set(mobs.count());
+
+    for(uint8_t i = 0; i < mobs.ndespawned; i++){
+        broadcastEntityDestroy(mobs.despawned[i]);
+    }
+    for(uint8_t i = 0; i < mobs.nspawned; i++){
+        for(auto &player : players){
+            if(player.connected){
+                player.writeSpawnMob(mobs.spawned[i]);
+            }
+        }
+    }
+    mobs.clearEvents();
+
+    if(tick % MOB_UPDATE_TICKS != 0){
+        return;
+    }
+    for(uint32_t i = 0; i < entities.end(); i++){
+        if(entities.kind[i] != ENTITY_MOB || !(entities.flags[i] & ENTITY_MOVED)){
+            continue;
+        }
+        entities.flags[i] &= ~ENTITY_MOVED;
+        broadcastPlayerPosAndLook(entities.x[i], entities.y[i], entities.z[i],
+                                  angle(entities.yaw[i]), angle(entities.pitch[i]),
+                                  entities.flags[i] & ENTITY_ON_GROUND, entities.id(i));
     }
 }
 
-void minecraft::player::handle(){
-	uint32_t length = readUnsignedLong();
-	uint32_t packetid = readUnsignedLong();
-	switch (packetid){
-	case 0x03:
-		readChat();
-		break;
-	case 0x12:
-		readPosition();
-		break;
-	case 0x14:
-		readRotation();
-		break;
-	case 0x10:
-		readKeepAlive();
-		break;
-	case 0x13:
-		readPositionAndLook();
-		break;
-	case 0x00:
-		readTeleportConfirm();
-		break;
-	case 0x2C:
-		readAnimation();
-		break;
-	case 0x1C:
-		readEntityAction();
-		break;
-	default:
-		//loginfo("id: 0x" + std::to_string(packetid, HEX) + " length: " + std::to_string(length));
-		for (int i = 0; i < length - VarIntLength(packetid); i++ ){
-			// loginfo("packet id " + std::to_string(packetid));
-			readByte();
+void minecraft::player::leave(){
+    connected = false;
+    mc->updateStatus();
+    if(entity != ENTITY_NONE){
+        mc->broadcastEntityDestroy(entity);
+        mc->broadcastPlayerRemove(id);
+        char line[48];
+        snprintf(line, sizeof(line), "%s left the server", username.c_str());
+        mc->broadcastChatMessage(line, "Server");
+        mc->entities.destroy(entity);
+        entity = ENTITY_NONE;
+    }
+
+    k_mutex_lock(&mtx, K_FOREVER);
+    (void)close(S);
+    out.close();
+    S = -1; // slot is free again
+    k_mutex_unlock(&mtx);
+    k_sem_give(&chat_free);
+    reclaimed.inc();
+    loginfo("connection reclaimed");
+}
+
+// Takes whatever the client sent, waiting for it unless the socket is non
+// blocking, and dispatches every frame completed by it. A frame split over
+// several segments simply waits in the decoder for the rest.
+bool minecraft::player::handle(){
+	uint32_t room;
+	uint8_t *to = decoder.space(&room);
+	int ret = recv(S, to, room, 0);
+	if(ret > 0){
+		decoder.commit(ret);
+	} else if(ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)){
+		return connected && !closed;
+	} else {
+		closed = true;
+		(ret == 0 ? disconnects_eof : disconnects_error).inc();
+		return false;
+	}
+
+	frame_view f;
+	frame_decoder::result res = frame_decoder::NEED_MORE;
+	while(!closed && (res = decoder.next(f)) == frame_decoder::FRAME){
+		dispatch(f);
+	}
+	if(res == frame_decoder::ERROR){
+		malformed_packets.inc();
+		closed = true; // the stream cannot be followed past a bad length
+	}
+	return connected && !closed;
+}
+
+void minecraft::player::dispatch(const frame_view &f){
+	packet_traffic.count(METRICS_IN, f.id, f.length);
+
+	const handler *h = NULL;
+	if(state < ARRAY_SIZE(dispatch_tables) && (uint32_t)f.id < dispatch_tables[state].count){
+		h = &dispatch_tables[state].handlers[f.id];
+	}
+	if(!h || !h->read || !f.data){
+		discarded_packets.inc();
+	} else if(f.size < h->min || f.size > h->max){
+		malformed_packets.inc();
+	} else {
+		in = f.data;
+		in_left = f.size;
+		overrun = false;
+		(this->*h->read)();
+		if(overrun){
+			malformed_packets.inc(); // fields past the end read as zeros
 		}
-		break;
+		in_left = 0;
 	}
 }
 
+void minecraft::player::updateRtt(uint32_t sample){
+    if(rtt == 0){
+        rtt = sample;
+    } else {
+        rtt = (7 * rtt + sample) / 8; // same smoothing as tcp srtt
+    }
+    logout("rtt %u ms", rtt);
+
+    uint32_t diff = rtt > rtt_reported ? rtt - rtt_reported : rtt_reported - rtt;
+    if(diff >= LATENCY_REPORT_MIN_MS && diff >= rtt_reported / 4){
+        rtt_reported = rtt;
+        mc->broadcastPlayerLatency(rtt, id);
+    }
+}
+
+// Checks a move against the last accepted position: no faster than flying
+// or falling allows and the player's box never inside a solid block on the
+// way. A rejected move is answered with a teleport back, moves are ignored
+// until the client confirms it.
+bool minecraft::player::move(const event &e){
+    if(teleport != 0){
+        return false;
+    }
+    entity_store &s = mc->entities;
+    uint32_t i = entity_index(entity);
+    int64_t now = k_uptime_get();
+    double dt = CLAMP(now - moved_at, TICK_MS, MOVE_MAX_ELAPSED_MS) / 1000.0;
+    double dx = e.move.x - s.x[i];
+    double dy = e.move.y - s.y[i];
+    double dz = e.move.z - s.z[i];
+    double horizontal = sqrt(dx * dx + dz * dz);
+    bool ok = horizontal <= MOVE_MAX_SPEED * dt + MOVE_SLACK &&
+              dy <= MOVE_MAX_SPEED * dt + MOVE_SLACK &&
+              -dy <= MOVE_MAX_FALL * dt + MOVE_SLACK;
+
+    // sample the path every half block so nothing is walked through,
+    // a player already stuck in a block may still leave it
+    const double r = PLAYER_WIDTH / 2 - 1e-3; // rounding of the client's own collision
+    auto collides = [&](double x, double y, double z){
+        return mc->map.collides(x - r, y + 1e-3, z - r, x + r, y + PLAYER_HEIGHT, z + r);
+    };
+    if(ok && !collides(s.x[i], s.y[i], s.z[i])){
+        int steps = MAX((int)ceil(sqrt(horizontal * horizontal + dy * dy) * 2), 1);
+        for(int k = 1; k <= steps && ok; k++){
+            double t = (double)k / steps;
+            ok = !collides(s.x[i] + dx * t, s.y[i] + dy * t, s.z[i] + dz * t);
+        }
+    }
+    if(!ok){
+        moves_rejected.inc();
+        correct();
+        return false;
+    }
+    moved_at = now;
+    return true;
+}
+
+// teleports the client back to where the server has it
+void minecraft::player::correct(){
+    entity_store &s = mc->entities;
+    uint32_t i = entity_index(entity);
+    teleport_next = teleport_next == INT32_MAX ? 1 : teleport_next + 1;
+    teleport = teleport_next;
+    writePlayerPositionAndLook(s.x[i], s.y[i], s.z[i], s.yaw[i], s.pitch[i], 0, teleport);
+}
+
+void minecraft::player::kick(const char *reason){
+    // whatever is queued is moot, the reason goes out next and only once
+	k_mutex_lock(&mtx, K_FOREVER);
+    out.discard();
+	k_mutex_unlock(&mtx);
+    writeDisconnect(reason);
+	k_mutex_lock(&mtx, K_FOREVER);
+    out.flush(S);
+	k_mutex_unlock(&mtx);
+    connected = false;
+    shutdown(S, SHUT_RDWR); // wakes the handler thread blocked in recv
+}
+
 // UTILITIES
-void minecraft::player::loginfo(std::string msg){
-    //Serial.println( "[INFO] p" + std::to_string(id) + " " + msg);
+void minecraft::player::loginfo(const char *fmt, ...){
+    // printk("[INFO] p%u ", id); va_list ap; va_start(ap, fmt); vprintk(fmt, ap); va_end(ap);
 }
 
-void minecraft::player::logerr(std::string msg){
-    //Serial.println( "[ERROR] p" + std::to_string(id) + " " + msg);
+void minecraft::player::logerr(const char *fmt, ...){
+    // printk("[ERROR] p%u ", id); va_list ap; va_start(ap, fmt); vprintk(fmt, ap); va_end(ap);
 }
 
-void minecraft::player::login(std::string msg){
-    //Serial.println( "[INFO] p" + std::to_string(id) + " <- " + msg);
+void minecraft::player::login(const char *fmt, ...){
+    // printk("[INFO] p%u <- ", id); va_list ap; va_start(ap, fmt); vprintk(fmt, ap); va_end(ap);
 }
 
-void minecraft::player::logout(std::string msg){
-    //Serial.println( "[INFO] p" + std::to_string(id) + " -> " + msg);
+void minecraft::player::logout(const char *fmt, ...){
+    // printk("[INFO] p%u -> ", id); va_list ap; va_start(ap, fmt); vprintk(fmt, ap); va_end(ap);
 }
 
 int32_t lsr(int32_t x, uint32_t n){
   return (int32_t)((uint32_t)x >> n);
 }
 
-uint32_t minecraft::player::VarIntLength(int val) {
-    if(val == 0){
-        return 1;
-    }
-    return (int)floor(log(val) / log(128)) + 1;
+// degrees to the protocol's 1/256 turn steps
+uint8_t angle(float deg){
+    return (uint8_t)(int)floor(fmap(deg, 0, 360, 0, 256));
 }
 
 float fmap(float x, float in_min, float in_max, float out_min, float out_max) {
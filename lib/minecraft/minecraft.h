@@ -1,31 +1,75 @@
 #ifndef MINECRAFT_H
 #define MINECRAFT_H
 
-#include <string>
 #include <zephyr/kernel.h>
 #include <stdint.h>
+#include "decoder.h"
+#include "entities.h"
+#include "events.h"
+#include "inline_string.h"
+#include "mobs.h"
+#include "metrics.h"
+#include "outbox.h"
+#include "shard.h"
+#include "world.h"
+
+#define TICK_MS 50
+#define KEEPALIVE_INTERVAL_MS 10000
+#define KEEPALIVE_TIMEOUT_MS 30000
+#define LATENCY_REPORT_MIN_MS 20 // smaller rtt changes are not worth a player info update
+#define MOB_UPDATE_TICKS 2 // mob movement goes out at 10 Hz
+#define VIEW_DISTANCE 12        // announced on join, for links that keep up
+#define VIEW_DISTANCE_MIN 2
+#define VIEW_FULL_RATE 24000    // B/s a link needs for the full view distance
+#define VIEW_UPDATE_TICKS 40    // view distance follows the link at most every 2 s
+
+#define PLAYER_WIDTH 0.6
+#define PLAYER_HEIGHT 1.8
+#define MOVE_MAX_SPEED 25.0     // blocks/s, a bit above sprint flying
+#define MOVE_MAX_FALL 80.0      // blocks/s, terminal velocity is under 80
+#define MOVE_SLACK 1.0          // blocks every move may be off by, packets bunch up
+#define MOVE_MAX_ELAPSED_MS 1000 // a quiet client does not save up distance
+#define TELEPORT_JOIN 0x55      // teleport id of the position in the join bundle
+
+#define PACKET_BUFFER_SIZE 512 // variable fields only, constant blobs are referenced
+#define RECEIVE_BUFFER_SIZE 1040 // largest handled frame, a chat message of 256 four byte characters
+
+#define STATE_HANDSHAKE 0       // connection states, numbered like the handshake's next state field
+#define STATE_STATUS 1
+#define STATE_LOGIN 2
+#define STATE_PLAY 3
 
 class packet{
     public:
-    uint8_t buffer[6000];
+    uint8_t buffer[PACKET_BUFFER_SIZE];
     uint32_t index = 0;
     int S;
 	struct k_mutex *mtx;
+    outbox *out;
+    struct iovec segments[OUTBOX_SEGMENTS];
+    uint8_t nsegments = 0;
+    uint32_t staged = 0;    // start of the buffer bytes not yet in a segment
+    uint32_t length = 0;    // payload bytes, staged and referenced
+    bool truncated = false; // ran out of room, the packet is dropped
 
-    packet(int __S, struct k_mutex *_mtx) {
+    packet(int __S, struct k_mutex *_mtx, outbox *_out) {
         S = __S;
         mtx = _mtx;
+        out = _out;
     }
 
     void write(uint8_t val);
-    void write(uint8_t * buf, size_t size);
-    void writePacket();
+    void write(const uint8_t * buf, size_t size);
+    void reference(const uint8_t * buf, size_t size); // sent in place, must stay valid and unchanged
+    void finish();
+    void writePacket(uint64_t key = 0);
 
     void writeDouble        (double value);
     void writeFloat         (float value);
     void writeVarInt        (int32_t value);
     void writeVarLong       (int64_t value);
-    void writeString        (std::string str);
+    void writeString        (const char *str, size_t size);
+    void writeString        (const char *str);
     void writeUnsignedLong  (uint64_t num);
     void writeUnsignedShort (uint16_t num);
     void writeUnsignedByte  (uint8_t num);
@@ -35,75 +79,103 @@ class packet{
     void writeByte          (int8_t num);
     void writeBoolean       (uint8_t val);
     void writeUUID          (int user_id);
+    void writeEntityUUID    (entity_id id);
+};
+
+BUILD_ASSERT(PACKET_BUFFER_SIZE < (1 << 14), "string lengths are patched as two byte VarInts");
+
+// JSON text component streamed into a packet as a protocol string. Two
+// bytes are held for the length and patched by end(), a padded VarInt
+// the client decodes like any other. Nothing is built on the heap.
+class json_text{
+    public:
+    json_text(packet &_p);
+
+    json_text &raw      (const char *json); // trusted, written as is
+    json_text &escaped  (const char *str);  // contents of a JSON string
+    json_text &escaped  (const char *str, size_t size);
+    void end            ();
+
+    private:
+    packet &p;
+    uint32_t at;
+};
 
-    // write to client
-    void serverWriteVarInt  (int32_t value);
+#define BUNDLE_BUFFER_SIZE 256
+#define BUNDLE_SEGMENTS 40
+#define BUNDLE_FRAMES 8
+
+// Several frames assembled once and sent with a single write. Small fields
+// are copied into the bundle, constant blobs stay referenced.
+class bundle{
+    public:
+    uint8_t buffer[BUNDLE_BUFFER_SIZE];
+    uint32_t index = 0;
+    struct iovec segments[BUNDLE_SEGMENTS];
+    uint8_t nsegments = 0;
+    size_t length = 0;
+    uint8_t ids[BUNDLE_FRAMES]; // per frame, for the traffic metrics
+    uint32_t lengths[BUNDLE_FRAMES];
+    uint8_t nframes = 0;
+
+    int32_t add(packet &p); // offset of the packet id in buffer, -1 if full
+    void prepare(struct iovec *iov, const uint8_t *staged); // segments over a patched copy of buffer
+    void writeBundle(int S, struct k_mutex *mtx, outbox *out, struct iovec *iov, int n, size_t more); // n segments, the bundle's first, more bytes of frames after them
+
+    private:
+    bool stage(const uint8_t *buf, size_t size);
 };
 
 class minecraft{
     public:
     class player {
         public:
-        struct k_mutex *mtx;
-        int S;
+        struct k_mutex mtx;
+        int S = -1;
         minecraft* mc;
         bool connected = false;
-		std::string username;
-        double x = 0;
-        double y = 5;
-        double z = 0;
-        double yaw = 0;
-        double pitch = 0;
-        int yaw_i = 0;
-        int pitch_i = 0;
-        bool on_ground = true;
-        float health = 0;
-        uint8_t food = 0;
-        float food_sat = 0;
-        uint8_t id = 0;
-
-		player() { // Initialize mtx to nullptr
-			mtx = (struct k_mutex *)k_malloc(sizeof(struct k_mutex));
-
-			if (mtx == NULL) {
-				// Allocation failed. Handle the error appropriately.
-				// For this example, we'll print an error message.
-				// In a real application, you might set an error flag,
-				// throw an exception (if using C++ exceptions), or take other actions.
-				//printk("Error: Failed to allocate memory for k_mutex in Player constructor.\n");
-				// mtx remains nullptr, indicating the object is not properly initialized.
-				return;
-			}
-
-			// Step 3: Initialize the mutex using k_mutex_init
-			// k_mutex_init takes a pointer to the k_mutex structure.
-			int ret = k_mutex_init(mtx);
-
-			// Step 4: Check if k_mutex_init was successful
-			// k_mutex_init returns 0 on success, and a negative error code on failure.
-			if (ret != 0) {
-				// Initialization failed. Handle the error.
-				//printk("Error: Failed to initialize k_mutex in Player constructor. Error code: %d\n", ret);
-				// Since initialization failed, free the previously allocated memory.
-				mtx = nullptr; // Set to nullptr to indicate failure.
-			} else {
-				//printk("Player mutex allocated and initialized successfully.\n");
-			}
-		}
+        bool closed = false; // socket hit EOF or an error, reads return zeros
+		player_name username;
+        uint8_t id = 0; // slot, also the uuid
+        entity_id entity = ENTITY_NONE; // position and rotation live in the entity store
+        int64_t keepalive_id = 0; // outstanding keepalive, 0 when answered
+        int64_t keepalive_sent = 0;
+        uint32_t rtt = 0; // smoothed round trip time in ms
+        uint32_t rtt_reported = 0;
+        int64_t moved_at = 0; // last accepted move
+        int32_t teleport = 0; // unconfirmed corrective teleport, moves are ignored until then
+        int32_t teleport_next = TELEPORT_JOIN;
+        chat_message chat; // filled by the connection thread, read by the game thread
+        uint8_t state = STATE_LOGIN;
+        uint8_t view = VIEW_DISTANCE; // as last told to the client
+        struct k_sem chat_free;
+        outbox out;
 
-		~player() {
-			if (mtx != nullptr) {
-				mtx = nullptr;
-			}
+        // serverbound packet of one state, the bounds are on the payload after the id
+        struct handler {
+            void (player::*read)(); // NULL: dropped unread
+            uint16_t min;
+            uint16_t max;
+        };
+
+		player() {
+			k_mutex_init(&mtx);
+			k_sem_init(&chat_free, 1, 1);
 		}
 
-        bool join               ();
-        void handle             ();
+		// the mutex lives inside the player, copies would lock a different one
+		player(const player &) = delete;
+		player &operator=(const player &) = delete;
+
+        // connection thread
+        bool join               (); // false if refused, the client was told why
+        bool handle             ();
+        void post               (const event &e);
 
-        uint8_t readHandShake   ();
-        bool readLoginStart     ();
-        uint64_t readPing       ();
-        void readRequest        ();
+        // game logic thread
+        void enter              ();
+        void leave              ();
+        void keepAlive          (int64_t payload);
 
         void readChat           ();
         void readPosition       ();
@@ -114,59 +186,102 @@ class minecraft{
         void readAnimation      ();
         void readEntityAction   ();
 
-        void writeResponse      ();
         void writeLoginSuccess  ();
-        void writeChunk         (uint8_t x, uint8_t y);
-        void writePlayerPositionAndLook(double x, double y, double z, float yaw, float pitch, uint8_t flags);
+        void writeLoginDisconnect(const char *reason);
+        void writePlayerPositionAndLook(double x, double y, double z, float yaw, float pitch, uint8_t flags, int32_t teleport);
         void writeKeepAlive     ();
-        void writeServerDifficulty();
-        void writeSpawnPlayer   (double x, double y, double z, int yaw, int pitch, uint8_t id);
-        void writeJoinGame      ();
-        void writePong          (uint64_t payload);
-        void writeChat          (std::string msg, std::string username);
-        void writeEntityTeleport(double x, double y, double z, int yaw, int pitch, bool on_ground, uint8_t id);
-        void writeEntityRotation(int yaw, int pitch, bool on_ground, uint8_t id);
-        void writeEntityLook    (int yaw, uint8_t id);
-        void writeEntityAnimation(uint8_t anim, uint8_t id);
-        void writeEntityAction  (uint8_t action, uint8_t id);
-        void writeEntityDestroy (uint8_t id);
-
-        void loginfo            (std::string msg);
-        void logerr             (std::string msg);
-        void login              (std::string msg);
-        void logout             (std::string msg);
+        void writeSpawnPlayer   (double x, double y, double z, int yaw, int pitch, entity_id id, uint8_t uuid);
+        void writeSpawnMob      (entity_id id);
+        void writeMirror        (const shard_mirror &m);
+        void writeMirrors       ();
+        void writeJoinBundle    ();
+        void writeViewDistance  (uint8_t distance);
+        void writeChat          (const char *msg, const char *username);
+        void writeEntityTeleport(double x, double y, double z, int yaw, int pitch, bool on_ground, entity_id id);
+        void writeEntityRotation(int yaw, int pitch, bool on_ground, entity_id id);
+        void writeEntityLook    (int yaw, entity_id id);
+        void writeEntityAnimation(uint8_t anim, entity_id id);
+        void writeEntityAction  (uint8_t action, entity_id id);
+        void writeEntityDestroy (entity_id id);
+        void writePlayerLatency (uint32_t ping, uint8_t id);
+        void writePlayerInfo    (const player *only);
+        void writePlayerRemove  (uint8_t id);
+        void writeDisconnect    (const char *reason);
+        void writeStats         ();
+
+        void kick               (const char *reason);
+        void updateRtt          (uint32_t sample);
+        void adaptView          ();
+        bool move               (const event &e);
+        void correct            ();
+
+        void loginfo            (const char *fmt, ...) __printf_like(2, 3);
+        void logerr             (const char *fmt, ...) __printf_like(2, 3);
+        void login              (const char *fmt, ...) __printf_like(2, 3);
+        void logout             (const char *fmt, ...) __printf_like(2, 3);
 
         float readFloat         ();
         double readDouble       ();
         int32_t readVarInt      ();
-        std::string readString       ();
+        uint16_t readString     (char *dst, size_t size); // bytes kept, the rest is skipped
+        template<size_t N> void readString(inline_string<N> &str){
+            str.len = readString(str.data, N);
+            str.data[str.len] = 0;
+        }
         int64_t readLong        ();
-        uint32_t readUnsignedLong();
         uint16_t readUnsignedShort();
-        uint32_t VarIntLength   (int val);
         uint8_t readByte        ();
         bool readBool           ();
+        bool receive            (void *buf, size_t size); // from the frame being dispatched
+        void skip               (uint32_t size);
+
+        private:
+        uint8_t rx[RECEIVE_BUFFER_SIZE];
+        frame_decoder decoder{rx, sizeof(rx)};
+        const uint8_t *in = NULL; // unread payload of the frame being dispatched
+        uint32_t in_left = 0;
+        bool overrun = false; // a reader wanted more than the frame has
 
-        void writeLength        (uint32_t length);
+        void dispatch           (const frame_view &f);
     };
 
     uint64_t tick = 0;
-    uint64_t prev_keepalive = 0;
+    int64_t last_tick = 0;
     player players[5];
+    entity_store entities;
+    world map;
+    mob_sim mobs{&entities, &map};
+    event_queue events;
+    shard_link shard;
 
+    void update                      ();
+    void idle                        ();
+    void apply                       (const event &e);
+    void flush                       ();
+    void printPlayers                (metrics_print_t print, void *ctx);
     void handle                      ();
-    void broadcastChatMessage        (std::string msg, std::string username);
-    void broadcastSpawnPlayer        ();
-    void broadcastPlayerPosAndLook   (double x, double y, double z, int yaw, int pitch, bool on_ground, uint8_t id);
-    void broadcastPlayerInfo         ();
-    void broadcastPlayerRotation     (int yaw, int pitch, bool on_ground, uint8_t id);
-    void broadcastEntityAnimation    (uint8_t anim, uint8_t id);
-    void broadcastEntityAction       (uint8_t action, uint8_t id);
-    void broadcastEntityDestroy      (uint8_t id);
+    void updateMobs                  ();
+    void updateShard                 ();
+    void applyBorder                 (uint8_t peer, const shard_link::entry *in, uint8_t n, int64_t now);
+    void dropMirror                  (uint8_t peer, uint8_t slot);
+    void broadcastChatMessage        (const char *msg, const char *username);
+    void broadcastSpawnPlayer        (player &joined);
+    void broadcastPlayerPosAndLook   (double x, double y, double z, int yaw, int pitch, bool on_ground, entity_id id);
+    void broadcastPlayerInfo         (player &joined);
+    void broadcastPlayerRemove       (uint8_t id);
+    void broadcastPlayerRotation     (int yaw, int pitch, bool on_ground, entity_id id);
+    void broadcastEntityAnimation    (uint8_t anim, entity_id id);
+    void broadcastEntityAction       (uint8_t action, entity_id id);
+    void broadcastEntityDestroy      (entity_id id);
+    void broadcastPlayerLatency      (uint32_t ping, uint8_t id);
     uint8_t getPlayerNum             ();
+    void buildJoinBundle             ();
+    void updateStatus                ();
+    int writeStatus                  (int S, uint32_t *sent, uint32_t *version); // 1 sent, 0 socket full, -1 failed
 };
 
 int32_t lsr(int32_t x, uint32_t n);
 float fmap(float x, float in_min, float in_max, float out_min, float out_max);
+uint8_t angle(float deg);
 
 #endif
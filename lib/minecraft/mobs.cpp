@@ -0,0 +1,340 @@
+#include "mobs.h"
+#include <math.h>
+#include <new>
+#include <stdlib.h>
+#include <zephyr/kernel.h>
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+static const uint8_t mob_types[] = {MOB_PIG, MOB_CHICKEN, MOB_COW};
+
+static uint32_t cell(int cx, int cz){
+    return ((uint32_t)cx * 73856093u ^ (uint32_t)cz * 19349663u) & (MOB_HASH_BUCKETS - 1);
+}
+
+static int cellOf(double v){
+    return (int)floor(v) >> MOB_HASH_SHIFT;
+}
+
+mob_sim::mob_sim(entity_store *_store, world *_map, uint32_t _seed){
+    store = _store;
+    map = _map;
+    seed = _seed ? _seed : 1;
+}
+
+// xorshift32, cheap and the benchmark stays repeatable
+uint32_t mob_sim::random(){
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+float mob_sim::uniform(){
+    return (random() >> 8) * (1.0f / (1 << 24));
+}
+
+bool mob_sim::solid(double x, double y, double z){
+    return map->solid((int)floor(x), (int)floor(y), (int)floor(z));
+}
+
+uint32_t mob_sim::count(){
+    return live;
+}
+
+void mob_sim::clearEvents(){
+    nspawned = 0;
+    ndespawned = 0;
+}
+
+entity_id mob_sim::spawn(uint8_t type, double x, double y, double z){
+    if(nspawned == MOB_EVENTS){
+        return ENTITY_NONE; // clients would never hear of it
+    }
+    entity_id e = store->create(ENTITY_MOB, type, x, y, z);
+    if(e == ENTITY_NONE){
+        return ENTITY_NONE;
+    }
+    uint32_t i = entity_index(e);
+    store->yaw[i] = uniform() * 360;
+    timer[i] = 1;
+    age[i] = 0;
+    walking[i] = false;
+    spawned[nspawned++] = e;
+    live++;
+    return e;
+}
+
+bool mob_sim::spawnRandom(){
+    const float size = WORLD_CHUNKS * 16;
+    double x = MOB_RADIUS + uniform() * (size - 2 * MOB_RADIUS);
+    double z = MOB_RADIUS + uniform() * (size - 2 * MOB_RADIUS);
+    // stand on the highest block, columns without one are void
+    for(int y = WORLD_HEIGHT - 1; y >= 0; y--){
+        if(solid(x, y, z)){
+            return spawn(mob_types[random() % ARRAY_SIZE(mob_types)], x, y + 1, z) != ENTITY_NONE;
+        }
+    }
+    return false;
+}
+
+void mob_sim::rebuild(){
+    for(auto &b : bucket){
+        b = -1;
+    }
+    uint32_t n = store->end();
+    for(uint32_t i = 0; i < n; i++){
+        if(store->kind[i] == ENTITY_FREE){
+            continue;
+        }
+        uint32_t b = cell(cellOf(store->x[i]), cellOf(store->z[i]));
+        next[i] = bucket[b];
+        bucket[b] = i;
+    }
+}
+
+uint32_t mob_sim::query(double x, double z, float r, uint16_t *out, uint32_t max){
+    uint32_t n = 0;
+    for(int cx = cellOf(x - r); cx <= cellOf(x + r); cx++){
+        for(int cz = cellOf(z - r); cz <= cellOf(z + r); cz++){
+            for(int16_t i = bucket[cell(cx, cz)]; i >= 0; i = next[i]){
+                // other cells share the bucket, take each entity from its own cell only
+                if(cellOf(store->x[i]) != cx || cellOf(store->z[i]) != cz){
+                    continue;
+                }
+                double dx = store->x[i] - x;
+                double dz = store->z[i] - z;
+                if(dx * dx + dz * dz > r * r){
+                    continue;
+                }
+                out[n++] = i;
+                if(n == max){
+                    return n;
+                }
+            }
+        }
+    }
+    return n;
+}
+
+uint32_t mob_sim::tick(uint32_t budget_us){
+    rebuild();
+    uint32_t n = store->end();
+    uint32_t budget = k_us_to_cyc_ceil32(budget_us);
+    uint32_t start = k_cycle_get_32();
+    uint32_t moved = 0;
+    for(uint32_t k = 0; k < n; k++){
+        uint32_t i = (cursor + k) % n;
+        if(store->kind[i] != ENTITY_MOB){
+            continue;
+        }
+        // the clock is only read every few mobs, one step is cheap
+        if(budget_us && (moved & 7) == 7 && k_cycle_get_32() - start > budget){
+            cursor = i; // the rest go first next tick
+            return moved;
+        }
+        step(i);
+        moved++;
+    }
+    return moved;
+}
+
+bool mob_sim::despawn(uint32_t i){
+    bool gone = store->y[i] < MOB_VOID_Y ||
+                (age[i] >= MOB_LIFETIME && random() % 200 == 0);
+    if(!gone || ndespawned == MOB_EVENTS){
+        return false;
+    }
+    entity_id e = store->id(i);
+    store->destroy(e);
+    despawned[ndespawned++] = e;
+    live--;
+    return true;
+}
+
+void mob_sim::think(uint32_t i){
+    timer[i] = 40 + random() % 100;
+
+    // look at the closest player in sight now and then
+    uint16_t near[16];
+    uint32_t n = query(store->x[i], store->z[i], MOB_SIGHT, near, ARRAY_SIZE(near));
+    int32_t target = -1;
+    double best = MOB_SIGHT * MOB_SIGHT;
+    for(uint32_t k = 0; k < n; k++){
+        uint32_t j = near[k];
+        if(store->kind[j] != ENTITY_PLAYER){
+            continue;
+        }
+        double dx = store->x[j] - store->x[i];
+        double dz = store->z[j] - store->z[i];
+        if(dx * dx + dz * dz < best){
+            best = dx * dx + dz * dz;
+            target = j;
+        }
+    }
+    if(target >= 0 && uniform() < 0.5f){
+        double dx = store->x[target] - store->x[i];
+        double dz = store->z[target] - store->z[i];
+        store->yaw[i] = atan2(-dx, dz) * (180 / M_PI);
+        walking[i] = false;
+    } else {
+        walking[i] = uniform() < 0.7f;
+        if(walking[i]){
+            store->yaw[i] = uniform() * 360;
+        }
+    }
+    store->flags[i] |= ENTITY_MOVED;
+}
+
+void mob_sim::step(uint32_t i){
+    age[i] = MIN(age[i] + 1, UINT16_MAX);
+    if(despawn(i)){
+        return;
+    }
+    if(--timer[i] == 0){
+        think(i);
+    }
+
+    double x = store->x[i];
+    double y = store->y[i];
+    double z = store->z[i];
+    bool ground = store->flags[i] & ENTITY_ON_GROUND;
+    float vx = 0;
+    float vz = 0;
+    float vy = (store->vy[i] - MOB_GRAVITY) * MOB_DRAG;
+
+    if(walking[i]){
+        float yaw = store->yaw[i] * (float)(M_PI / 180);
+        vx = -sinf(yaw) * MOB_SPEED;
+        vz = cosf(yaw) * MOB_SPEED;
+    }
+
+    // push apart from whatever overlaps us
+    uint16_t near[8];
+    uint32_t n = query(x, z, 2 * MOB_RADIUS, near, ARRAY_SIZE(near));
+    for(uint32_t k = 0; k < n; k++){
+        uint32_t j = near[k];
+        double dx = x - store->x[j];
+        double dz = z - store->z[j];
+        double d = sqrt(dx * dx + dz * dz);
+        if(j == i || d < 1e-3 || fabs(y - store->y[j]) > MOB_HEIGHT){
+            continue;
+        }
+        float push = (2 * MOB_RADIUS - d) / d * 0.25f;
+        vx += dx * push;
+        vz += dz * push;
+    }
+
+    // one axis at a time so mobs slide along walls, a single block is
+    // jumped onto
+    const double size = WORLD_CHUNKS * 16;
+    double nx = x + vx;
+    double edge = nx + (vx > 0 ? MOB_RADIUS : -MOB_RADIUS);
+    if(vx != 0 && (solid(edge, y, z) || solid(edge, y + MOB_HEIGHT, z))){
+        if(ground && !solid(edge, y + 1, z) && !solid(edge, y + 1 + MOB_HEIGHT, z)){
+            vy = MOB_JUMP;
+        }
+        nx = x;
+    }
+    double nz = z + vz;
+    edge = nz + (vz > 0 ? MOB_RADIUS : -MOB_RADIUS);
+    if(vz != 0 && (solid(nx, y, edge) || solid(nx, y + MOB_HEIGHT, edge))){
+        if(ground && !solid(nx, y + 1, edge) && !solid(nx, y + 1 + MOB_HEIGHT, edge)){
+            vy = MOB_JUMP;
+        }
+        nz = z;
+    }
+    if(nx < MOB_RADIUS || nx > size - MOB_RADIUS || nz < MOB_RADIUS || nz > size - MOB_RADIUS){
+        // turn around at the edge of the world instead of walking off
+        nx = x;
+        nz = z;
+        store->yaw[i] = fmodf(store->yaw[i] + 180, 360);
+        store->flags[i] |= ENTITY_MOVED;
+    }
+
+    double ny = y + vy;
+    ground = false;
+    if(vy < 0 && solid(nx, ny, nz)){
+        ny = floor(ny) + 1;
+        vy = 0;
+        ground = true;
+    } else if(vy > 0 && solid(nx, ny + MOB_HEIGHT, nz)){
+        ny = y;
+        vy = 0;
+    }
+
+    store->vx[i] = nx - x;
+    store->vy[i] = vy;
+    store->vz[i] = nz - z;
+    if(nx != x || ny != y || nz != z){
+        store->x[i] = nx;
+        store->y[i] = ny;
+        store->z[i] = nz;
+        store->flags[i] |= ENTITY_MOVED;
+    }
+    if(ground){
+        store->flags[i] |= ENTITY_ON_GROUND;
+    } else {
+        store->flags[i] &= ~ENTITY_ON_GROUND;
+    }
+}
+
+// SHELL
+#if defined(CONFIG_SHELL)
+// ticks per second of the simulation alone, against an untouched copy of
+// the world and a store of the live one's capacity, so the running server
+// and its gauges are not disturbed
+static int cmd_bench_mobs(const struct shell *sh, size_t argc, char **argv){
+    uint32_t ticks = argc > 1 ? strtoul(argv[1], NULL, 10) : 200;
+    entity_store *store = (entity_store *)k_malloc(sizeof(entity_store));
+    mob_sim *sim = (mob_sim *)k_malloc(sizeof(mob_sim));
+    world *flat = (world *)k_malloc(sizeof(world));
+    if(!store || !sim || !flat || ticks == 0){
+        shell_error(sh, "need %u bytes of heap and at least one tick",
+                    (unsigned)(sizeof(entity_store) + sizeof(mob_sim) + sizeof(world)));
+        k_free(store);
+        k_free(sim);
+        k_free(flat);
+        return -ENOMEM;
+    }
+    new (flat) world(); // only flash templates
+    if(!flat->init()){
+        shell_error(sh, "world pool spent");
+        flat->~world();
+        k_free(store);
+        k_free(sim);
+        k_free(flat);
+        return -ENOMEM;
+    }
+
+    shell_print(sh, "%8s %10s %10s", "mobs", "ticks/s", "us/tick");
+    for(uint32_t mobs = 16; ; mobs *= 2){
+        mobs = MIN(mobs, (uint32_t)MAX_ENTITIES);
+        new (store) entity_store(false);
+        new (sim) mob_sim(store, flat, 1);
+        while(sim->count() < mobs && sim->spawnRandom()){
+            sim->clearEvents();
+        }
+        int64_t start = k_uptime_ticks();
+        for(uint32_t t = 0; t < ticks; t++){
+            sim->tick(0);
+            sim->clearEvents();
+        }
+        uint64_t us = MAX(k_ticks_to_us_floor64(k_uptime_ticks() - start), 1);
+        shell_print(sh, "%8u %10u %10u", sim->count(),
+                    (uint32_t)(ticks * 1000000ull / us), (uint32_t)(us / ticks));
+        if(mobs == MAX_ENTITIES){
+            break;
+        }
+    }
+    flat->~world();
+    k_free(store);
+    k_free(sim);
+    k_free(flat);
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((mc, bench), mobs, NULL, "Mob ticks per second against mob count: mobs [ticks]", cmd_bench_mobs, 1, 1);
+#endif
@@ -0,0 +1,73 @@
+#ifndef MOBS_H
+#define MOBS_H
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+#include "entities.h"
+#include "world.h"
+
+#define MOB_PIG 59              // entity type ids of protocol 754
+#define MOB_CHICKEN 9
+#define MOB_COW 11
+
+#define MOB_GRAVITY 0.08f       // blocks/tick^2, vanilla values
+#define MOB_DRAG 0.98f
+#define MOB_JUMP 0.42f
+#define MOB_SPEED 0.1f          // blocks/tick while wandering
+#define MOB_RADIUS 0.3f
+#define MOB_HEIGHT 0.9f
+#define MOB_SIGHT 8.0f          // players closer than this get looked at
+#define MOB_LIFETIME 6000       // ticks, about five minutes
+#define MOB_VOID_Y -16          // fell out of the world
+
+#define MOB_HASH_SHIFT 2        // 4x4 block cells
+#define MOB_HASH_BUCKETS 256    // power of two
+#define MOB_EVENTS 16           // spawns or despawns per tick the broadcaster hears of
+
+BUILD_ASSERT((MOB_HASH_BUCKETS & (MOB_HASH_BUCKETS - 1)) == 0, "hash buckets must be a power of two");
+
+// Server side mobs. Their state is the entity store's, only what the
+// simulation alone needs sits here, in arrays indexed like the store. All
+// entities are bucketed into a spatial hash at the start of every tick for
+// neighbour queries. tick() stops at its time budget and continues with the
+// next mob on the following tick.
+class mob_sim {
+    public:
+    entity_store *store;
+    world *map;
+
+    // what changed in the last tick, cleared by the broadcaster
+    entity_id spawned[MOB_EVENTS];
+    entity_id despawned[MOB_EVENTS];
+    uint8_t nspawned = 0;
+    uint8_t ndespawned = 0;
+
+    mob_sim(entity_store *_store, world *_map, uint32_t seed = 1);
+
+    entity_id spawn     (uint8_t type, double x, double y, double z);
+    bool spawnRandom    (); // somewhere inside the world
+    uint32_t tick       (uint32_t budget_us); // returns the number of mobs moved
+    uint32_t count      ();
+    uint32_t query      (double x, double z, float r, uint16_t *out, uint32_t max);
+    void clearEvents    ();
+
+    private:
+    uint16_t timer[MAX_ENTITIES];   // ticks until the next wander decision
+    uint16_t age[MAX_ENTITIES];
+    bool walking[MAX_ENTITIES];
+    int16_t bucket[MOB_HASH_BUCKETS];
+    int16_t next[MAX_ENTITIES];
+    uint32_t cursor = 0;
+    uint32_t live = 0;
+    uint32_t seed;
+
+    uint32_t random     ();
+    float uniform       (); // 0..1
+    bool solid          (double x, double y, double z);
+    void rebuild        ();
+    void think          (uint32_t i);
+    void step           (uint32_t i);
+    bool despawn        (uint32_t i);
+};
+
+#endif
@@ -0,0 +1,311 @@
+#include "outbox.h"
+#include "metrics.h"
+#include "pools.h"
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/socket.h>
+
+static counter collapsed("outbox.collapsed");
+static counter overflows("outbox.overflow");
+static histogram stall_time("stall", "ms");
+
+static size_t putVarInt(uint8_t *buf, uint32_t value){
+    size_t n = 0;
+    do {
+        uint8_t temp = (uint8_t)(value & 0b01111111);
+        value >>= 7;
+        if (value != 0) {
+            temp |= 0b10000000;
+        }
+        buf[n++] = temp;
+    } while (value != 0);
+    return n;
+}
+
+bool outbox::open(){
+    reset();
+    if(!data){
+        data = (uint8_t *)net_pool.alloc(OUTBOX_SIZE);
+    }
+    return data != NULL;
+}
+
+void outbox::close(){
+    net_pool.free(data);
+    data = nullptr;
+    reset();
+}
+
+void outbox::reset(){
+    blocking = true;
+    overflow = false;
+    stall_ms = 0;
+    stalls = 0;
+    head = 0;
+    used = 0;
+    in_flight = 0;
+    nstates = 0;
+    stall_start = 0;
+    rate = OUTBOX_RATE_INITIAL;
+    sent = 0;
+    congested = false;
+    sampled_at = k_uptime_get();
+    raised_at = sampled_at;
+    allowance = 0;
+    spent = 0;
+}
+
+uint32_t outbox::backlog(){
+    return used;
+}
+
+uint32_t outbox::stalled(){
+    return stall_start ? k_uptime_get() - stall_start : 0;
+}
+
+// step over r sent bytes
+static void advance(struct msghdr *msg, size_t r){
+    while(msg->msg_iovlen > 0 && r >= msg->msg_iov->iov_len){
+        r -= msg->msg_iov->iov_len;
+        msg->msg_iov++;
+        msg->msg_iovlen--;
+    }
+    if(msg->msg_iovlen > 0){
+        msg->msg_iov->iov_base = (uint8_t *)msg->msg_iov->iov_base + r;
+        msg->msg_iov->iov_len -= r;
+    }
+}
+
+bool outbox::write(int S, const struct iovec *payload, int segments, size_t len, uint64_t key){
+    uint8_t hdr[5];
+    struct iovec iov[OUTBOX_SEGMENTS + 1];
+    __ASSERT_NO_MSG(segments <= OUTBOX_SEGMENTS);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = putVarInt(hdr, len);
+    for(int i = 0; i < segments; i++){
+        iov[i + 1] = payload[i];
+    }
+    return submit(S, iov, segments + 1, iov[0].iov_len + len, key);
+}
+
+bool outbox::writeFramed(int S, struct iovec *frames, int segments, size_t len){
+    return submit(S, frames, segments, len, 0);
+}
+
+bool outbox::submit(int S, struct iovec *iov, int n, size_t total, uint64_t key){
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+
+    if(blocking){
+        // only the connection thread writes before the player is visible,
+        // blocking here stalls nobody else
+        while(msg.msg_iovlen > 0){
+            ssize_t r = sendmsg(S, &msg, 0);
+            if(r <= 0){
+                return false;
+            }
+            advance(&msg, r);
+        }
+        return true;
+    }
+
+    if(overflow){
+        return false;
+    }
+
+    // a state already waiting is replaced where it waits, it must not be
+    // overtaken by an older copy of itself
+    bool over = allowance != 0 && spent >= allowance;
+    bool waiting = key != 0 && pending(key);
+    if(key != 0 && (over || used >= OUTBOX_SOFT_LIMIT || waiting) && collapse(iov, n, total, key)){
+        return true;
+    }
+    if(key == 0 || waiting){
+        release(); // collapsed before this frame, they go first
+    }
+    spent += total;
+
+    if(used == 0){
+        ssize_t r = sendmsg(S, &msg, ZSOCK_MSG_DONTWAIT);
+        if(r < 0){
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                return false; // the connection thread notices the dead socket
+            }
+            r = 0;
+        }
+        sent += r;
+        if((size_t)r == total){
+            return true;
+        }
+        congested = true;
+        // keep the rest of the frame, the stream must stay intact
+        in_flight = total - r;
+        advance(&msg, r);
+        for(size_t i = 0; i < msg.msg_iovlen; i++){
+            append((const uint8_t *)msg.msg_iov[i].iov_base, msg.msg_iov[i].iov_len);
+        }
+        account();
+        return !overflow;
+    }
+
+    for(int i = 0; i < n; i++){
+        append((const uint8_t *)iov[i].iov_base, iov[i].iov_len);
+    }
+    return !overflow;
+}
+
+void outbox::flush(int S){
+    if(blocking || S < 0){
+        return;
+    }
+    drain(S);
+    if(used < OUTBOX_SOFT_LIMIT && nstates > 0 && (allowance == 0 || spent < allowance)){
+        // link caught up, release the latest state of every collapsed entity
+        release();
+        drain(S);
+    }
+    account();
+}
+
+bool outbox::append(const uint8_t *buf, size_t len){
+    if(!data || used + len > OUTBOX_SIZE){
+        if(!overflow){
+            overflows.inc();
+        }
+        overflow = true;
+        return false;
+    }
+    uint32_t tail = (head + used) % OUTBOX_SIZE;
+    size_t first = MIN(len, (size_t)(OUTBOX_SIZE - tail));
+    memcpy(data + tail, buf, first);
+    memcpy(data, buf + first, len - first);
+    used += len;
+    return true;
+}
+
+bool outbox::collapse(const struct iovec *iov, int n, size_t len, uint64_t key){
+    if(len > OUTBOX_STATE_SIZE){
+        return false;
+    }
+    uint8_t i;
+    for(i = 0; i < nstates; i++){
+        if(states[i].key == key){
+            collapsed.inc(); // the queued one is stale now
+            break;
+        }
+    }
+    if(i == nstates){
+        if(nstates == OUTBOX_STATE_SLOTS){
+            return false; // no room to collapse, queue it normally
+        }
+        nstates++;
+    }
+    states[i].key = key;
+    states[i].len = 0;
+    for(int j = 0; j < n; j++){
+        memcpy(states[i].frame + states[i].len, iov[j].iov_base, iov[j].iov_len);
+        states[i].len += iov[j].iov_len;
+    }
+    return true;
+}
+
+bool outbox::pending(uint64_t key){
+    for(uint8_t i = 0; i < nstates; i++){
+        if(states[i].key == key){
+            return true;
+        }
+    }
+    return false;
+}
+
+void outbox::release(){
+    for(uint8_t i = 0; i < nstates; i++){
+        append(states[i].frame, states[i].len);
+        spent += states[i].len;
+    }
+    nstates = 0;
+}
+
+// frame boundaries are only known at the queue head, follow them through
+// the length prefixes of the frames as they are sent
+void outbox::consumed(uint32_t sent){
+    uint32_t pos = head;
+    while(sent > 0){
+        if(in_flight == 0){
+            uint32_t len = 0;
+            uint32_t n = 0;
+            uint8_t b;
+            do {
+                b = data[(pos + n) % OUTBOX_SIZE];
+                len |= (uint32_t)(b & 0x7F) << (7 * n);
+                n++;
+            } while((b & 0x80) && n < 5);
+            in_flight = n + len;
+        }
+        uint32_t step = MIN(sent, in_flight);
+        in_flight -= step;
+        sent -= step;
+        pos = (pos + step) % OUTBOX_SIZE;
+    }
+}
+
+void outbox::discard(){
+    // a frame cut off half way would garble everything after it
+    used = in_flight;
+    nstates = 0;
+    overflow = false;
+}
+
+void outbox::drain(int S){
+    while(used > 0){
+        size_t n = MIN((size_t)used, (size_t)(OUTBOX_SIZE - head));
+        ssize_t r = send(S, data + head, n, ZSOCK_MSG_DONTWAIT);
+        if(r <= 0){
+            congested = true;
+            return; // EAGAIN or a dead socket, either way try next tick
+        }
+        sent += r;
+        consumed(r);
+        head = (head + r) % OUTBOX_SIZE;
+        used -= r;
+    }
+    head = 0;
+}
+
+void outbox::account(){
+    bool backed_up = used > 0 || nstates > 0;
+    if(backed_up && stall_start == 0){
+        stall_start = k_uptime_get();
+        stalls++;
+    } else if(!backed_up && stall_start != 0){
+        uint32_t ms = k_uptime_get() - stall_start;
+        stall_ms += ms;
+        stall_time.record(ms);
+        stall_start = 0;
+    }
+}
+
+void outbox::tick(uint32_t period_ms, uint32_t rtt){
+    int64_t now = k_uptime_get();
+    uint32_t elapsed = now - sampled_at;
+    if(elapsed == 0){
+        return;
+    }
+    if(congested){
+        // the socket took all it could, that is what the link carries
+        uint32_t sample = (uint64_t)sent * 1000 / elapsed;
+        rate = (3 * (uint64_t)rate + sample) / 4;
+    } else if(allowance != 0 && spent * 2 >= allowance && now - raised_at >= MAX(rtt, period_ms)){
+        // the budget was used and the link kept up, probe once per round trip
+        rate += rate / 8;
+        raised_at = now;
+    }
+    rate = CLAMP(rate, OUTBOX_RATE_MIN, OUTBOX_RATE_MAX);
+
+    allowance = MAX((uint64_t)rate * period_ms / 1000, 1);
+    spent = 0;
+    sent = 0;
+    congested = false;
+    sampled_at = now;
+}
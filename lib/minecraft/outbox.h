@@ -0,0 +1,85 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/socket.h>
+
+#define OUTBOX_SIZE 4096        // hard limit, a client further behind is kicked
+#define OUTBOX_SOFT_LIMIT 1024  // above this state packets are collapsed
+#define OUTBOX_STATE_SLOTS 8
+#define OUTBOX_STATE_SIZE 48    // largest collapsible frame (entity teleport)
+#define OUTBOX_SEGMENTS 10      // payload pieces per frame, the length prefix comes on top
+#define OUTBOX_RATE_INITIAL 32000   // B/s until the link has shown what it takes
+#define OUTBOX_RATE_MIN 1000
+#define OUTBOX_RATE_MAX 1000000
+
+// key for packets that only carry the latest state of an entity, a newer
+// one with the same key makes the older one worthless. Entity ids are never
+// 0, so neither is a key.
+#define OUTBOX_STATE(packet_id, entity) (((uint64_t)(entity) << 8) | (packet_id))
+
+// Outbound queue of one client. Frames are written straight to the socket
+// without blocking; whatever the socket does not take waits here and is
+// flushed by the game thread. A congested link therefore only ever delays
+// itself. Frames arrive as a list of pieces so large constant blobs go to
+// the socket in place, they are only copied if the socket refuses them.
+// The queue memory comes from the network pool while a client is connected.
+// What the socket takes while backed up is the link's throughput; the
+// estimate sets a byte budget per tick, state packets beyond it wait for
+// the next tick and get collapsed meanwhile, so a slow link receives
+// fewer, newer updates instead of a growing queue. A frame that is not a
+// state releases the collapsed ones ahead of itself, so no state arrives
+// after a frame queued later, such as a move after the entity's destroy.
+class outbox {
+    public:
+    bool blocking = true;       // login sequence, before the player is visible
+    bool overflow = false;      // hard limit hit, the client has to go
+    uint32_t stall_ms = 0;      // total time spent with a backlog
+    uint32_t stalls = 0;
+    uint32_t rate = OUTBOX_RATE_INITIAL; // estimated link throughput in B/s
+
+    bool open           (); // false if the network pool is spent
+    void close          ();
+    void reset          ();
+    bool write          (int S, const struct iovec *payload, int segments, size_t len, uint64_t key);
+    bool writeFramed    (int S, struct iovec *frames, int segments, size_t len); // already length prefixed
+    void flush          (int S);
+    uint32_t backlog    ();
+    uint32_t stalled    (); // current stall in ms, 0 if drained
+    void discard        (); // drops the queue but the rest of a frame on the wire
+    void tick           (uint32_t period_ms, uint32_t rtt); // new estimate and budget
+
+    private:
+    struct state {
+        uint64_t key;
+        uint16_t len;
+        uint8_t frame[OUTBOX_STATE_SIZE];
+    };
+
+    uint8_t *data = nullptr;    // OUTBOX_SIZE bytes
+    uint32_t head = 0;
+    uint32_t used = 0;
+    uint32_t in_flight = 0;     // unsent bytes of the frame at head, 0 if head starts one
+    state states[OUTBOX_STATE_SLOTS];
+    uint8_t nstates = 0;
+    int64_t stall_start = 0;
+    uint32_t sent = 0;          // taken by the socket since the last tick
+    bool congested = false;     // the socket refused bytes since the last tick
+    int64_t sampled_at = 0;
+    int64_t raised_at = 0;
+    uint32_t allowance = 0;     // bytes per tick, 0 before the first tick
+    uint32_t spent = 0;
+
+    bool submit         (int S, struct iovec *iov, int n, size_t len, uint64_t key);
+    bool append         (const uint8_t *buf, size_t len);
+    bool collapse       (const struct iovec *iov, int n, size_t len, uint64_t key);
+    bool pending        (uint64_t key);
+    void release        ();
+    void drain          (int S);
+    void consumed       (uint32_t sent);
+    void account        ();
+};
+
+#endif
@@ -0,0 +1,90 @@
+#include "pools.h"
+#include <stdio.h>
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+#define POOL_HEADER 8 // requested size in front of each block, keeps 8 byte alignment
+
+// zero initialized before any constructor runs, like the metrics registry
+static mem_pool *pools = nullptr;
+
+K_HEAP_DEFINE(net_heap, CONFIG_MC_NET_POOL_SIZE);
+K_HEAP_DEFINE(world_heap, CONFIG_MC_WORLD_POOL_SIZE);
+
+mem_pool net_pool("net", &net_heap, CONFIG_MC_NET_POOL_SIZE);
+mem_pool world_pool("world", &world_heap, CONFIG_MC_WORLD_POOL_SIZE);
+
+static report pools_section("pools", pools_report);
+
+mem_pool::mem_pool(const char *_name, struct k_heap *_heap, size_t _budget){
+    name = _name;
+    heap = _heap;
+    total = _budget;
+    next = pools;
+    pools = this;
+}
+
+mem_pool *mem_pool::first(){
+    return pools;
+}
+
+void *mem_pool::alloc(size_t size){
+    uint8_t *block = (uint8_t *)k_heap_alloc(heap, size + POOL_HEADER, K_NO_WAIT);
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if(!block){
+        failed++;
+        k_spin_unlock(&lock, key);
+        return NULL;
+    }
+    in_use += size;
+    high = MAX(high, in_use);
+    k_spin_unlock(&lock, key);
+    *(size_t *)block = size;
+    return block + POOL_HEADER;
+}
+
+void mem_pool::free(void *ptr){
+    if(!ptr){
+        return;
+    }
+    uint8_t *block = (uint8_t *)ptr - POOL_HEADER;
+    size_t size = *(size_t *)block;
+    k_heap_free(heap, block);
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    in_use -= size;
+    k_spin_unlock(&lock, key);
+}
+
+void pools_report(metrics_print_t print, void *ctx){
+    char line[96];
+    uint32_t failed = 0;
+    for(mem_pool *p = pools; p; p = p->next){
+        snprintf(line, sizeof(line), "pool %s %u B used, %u B peak of %u B, %u failed",
+                 p->name, (unsigned)p->used(), (unsigned)p->peak(), (unsigned)p->budget(),
+                 p->failures());
+        print(ctx, line);
+        failed += p->failures();
+    }
+    snprintf(line, sizeof(line), "pools %u failed", failed);
+    print(ctx, line);
+}
+
+// SHELL
+#if defined(CONFIG_SHELL)
+static void shellPrint(void *ctx, const char *line){
+    shell_print((const struct shell *)ctx, "%s", line);
+}
+
+static int cmd_pools(const struct shell *sh, size_t argc, char **argv){
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+    pools_report(shellPrint, (void *)sh);
+    return 0;
+}
+
+SHELL_SUBCMD_ADD((mc), pools, NULL, "Memory budget, usage and high water mark per subsystem", cmd_pools, 1, 0);
+#endif
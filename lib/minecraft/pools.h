@@ -0,0 +1,45 @@
+#ifndef POOLS_H
+#define POOLS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+#include "metrics.h"
+
+// Fixed budget heap of one subsystem. Running out fails the allocation of
+// that subsystem only, never someone else's, and the high water mark tells
+// how much of the budget a board really needs. Pools register themselves
+// like the metrics and show up in the stats dump.
+class mem_pool {
+    public:
+    const char *name;
+    mem_pool *next;
+
+    mem_pool(const char *_name, struct k_heap *_heap, size_t _budget);
+
+    void *alloc         (size_t size); // NULL once the budget is spent
+    void free           (void *ptr);
+
+    size_t budget       () { return total; }
+    size_t used         () { return in_use; }
+    size_t peak         () { return high; }
+    uint32_t failures   () { return failed; }
+
+    static mem_pool *first(); // all pools, for reports
+
+    private:
+    struct k_heap *heap;
+    size_t total;
+    size_t in_use = 0;
+    size_t high = 0;
+    uint32_t failed = 0;
+    struct k_spinlock lock = {};
+};
+
+extern mem_pool net_pool;       // client send buffers
+extern mem_pool world_pool;     // edited world sections
+
+void pools_report(metrics_print_t print, void *ctx);
+
+#endif
@@ -0,0 +1,224 @@
+#include "proxy.h"
+#include "decoder.h"
+#include "inline_string.h"
+#include "metrics.h"
+#include "minecraft.h"
+#include "shard.h"
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/socket.h>
+
+static counter routed("proxy.routed");
+static counter unroutable("proxy.unroutable");
+static counter proxy_full("proxy.full");
+static gauge open_links("proxy.links");
+
+// a VarInt that has to be complete, the whole frame is buffered
+static bool take(const uint8_t *&p, const uint8_t *end, int32_t *value){
+    int n = getVarInt(p, end - p, value);
+    if(n <= 0){
+        return false;
+    }
+    p += n;
+    return true;
+}
+
+// Shard of the connection from its first frames: -1 while they are
+// incomplete, -2 if they are not a handshake and a login or status request.
+static int destination(const uint8_t *buf, uint32_t size){
+    const uint8_t *p = buf;
+    const uint8_t *end = buf + size;
+    int32_t length, id, value;
+
+    // Handshake: protocol version, server address, port, next state
+    int n = getVarInt(p, end - p, &length);
+    if(n <= 0){
+        return n < 0 ? -2 : -1;
+    }
+    p += n;
+    if(end - p < length){
+        return -1;
+    }
+    const uint8_t *frame = p + length;
+    if(!take(p, frame, &id) || id != 0x00 || !take(p, frame, &value) || !take(p, frame, &length) ||
+       length < 0 || frame - p < length + 2){
+        return -2;
+    }
+    p += length + 2;
+    if(!take(p, frame, &value)){
+        return -2;
+    }
+    if(value == STATE_STATUS){
+        return 0;
+    } else if(value != STATE_LOGIN){
+        return -2;
+    }
+
+    // Login Start: name
+    p = frame;
+    n = getVarInt(p, end - p, &length);
+    if(n <= 0){
+        return n < 0 ? -2 : -1;
+    }
+    p += n;
+    if(end - p < length){
+        return -1;
+    }
+    frame = p + length;
+    if(!take(p, frame, &id) || id != 0x00 || !take(p, frame, &length) || length < 0 || frame - p < length){
+        return -2;
+    }
+    player_name name; // cut like the shard will cut it, the spawn follows from what is kept
+    name.assign((const char *)p, length);
+    uint8_t cx, cz;
+    shard_spawn(name.c_str(), name.length(), &cx, &cz);
+    return shard_owner(cx);
+}
+
+void proxy::run(int listener, admission *gate){
+    while(true){
+        struct pollfd fds[1 + 2 * PROXY_CONNECTIONS];
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+
+        int64_t now = k_uptime_get();
+        int timeout = -1;
+        for(int i = 0; i < PROXY_CONNECTIONS; i++){
+            link &l = links[i];
+            struct pollfd &c = fds[1 + 2 * i];
+            struct pollfd &s = fds[2 + 2 * i];
+            if(l.shard < 0){
+                c.events = POLLIN; // the login, up to the routing deadline
+                s.events = 0;
+                if(l.client >= 0){
+                    int left = MAX(l.deadline - now, 0);
+                    timeout = (timeout < 0) ? left : MIN(timeout, left);
+                }
+            } else {
+                c.events = (l.up.head == l.up.tail ? POLLIN : 0) | (l.down.head != l.down.tail ? POLLOUT : 0);
+                s.events = (l.down.head == l.down.tail ? POLLIN : 0) | (l.up.head != l.up.tail ? POLLOUT : 0);
+            }
+            // a side with nothing to do is left out, its hangup waits until
+            // what it sent has been passed on
+            c.fd = c.events ? l.client : -1;
+            s.fd = s.events ? l.shard : -1;
+        }
+
+        if(poll(fds, ARRAY_SIZE(fds), timeout) < 0){
+            return;
+        }
+
+        now = k_uptime_get();
+        for(int i = 0; i < PROXY_CONNECTIONS; i++){
+            link &l = links[i];
+            if(l.client < 0){
+                continue;
+            }
+            short c = fds[1 + 2 * i].revents;
+            short s = fds[2 + 2 * i].revents;
+            if(l.shard < 0){
+                if(c && (!forward(l.client, -1, l.up, true) || !route(l))){
+                    close(l);
+                } else if(l.shard < 0 && now >= l.deadline){
+                    unroutable.inc();
+                    close(l);
+                }
+                continue;
+            }
+            if(!forward(l.client, l.shard, l.up, c != 0) || !forward(l.shard, l.client, l.down, s != 0)){
+                close(l);
+            }
+        }
+
+        if(fds[0].revents & POLLIN){
+            accept(listener, gate);
+        }
+    }
+}
+
+void proxy::accept(int listener, admission *gate){
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    int client = ::accept(listener, (struct sockaddr *)&from, &from_len);
+    if(client < 0){
+        return;
+    }
+    if(!gate->admit(from.sin_addr.s_addr, k_uptime_get())){
+        (void)::close(client);
+        return;
+    }
+    for(auto &l : links){
+        if(l.client < 0){
+            l.client = client;
+            l.deadline = k_uptime_get() + CONFIG_MC_HANDSHAKE_TIMEOUT_MS;
+            open_links.inc();
+            return;
+        }
+    }
+    proxy_full.inc();
+    (void)::close(client);
+}
+
+// Connects to the shard once the buffered frames name it. The frames stay
+// in the up relay and go out to the shard like any later bytes.
+bool proxy::route(link &l){
+    int to = destination(l.up.buffer, l.up.tail);
+    if(to == -1){
+        return l.up.tail < sizeof(l.up.buffer);
+    }
+    struct sockaddr_in addr;
+    if(to < 0 || !shard_address(to, &addr)){
+        unroutable.inc();
+        return false;
+    }
+    l.shard = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(l.shard < 0){
+        return false;
+    }
+    if(connect(l.shard, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        unroutable.inc();
+        return false;
+    }
+    routed.inc();
+    return forward(l.client, l.shard, l.up, false);
+}
+
+// Reads into the relay when asked to and it is empty, then passes on what
+// it holds. to < 0 only collects. False once either side is closed.
+bool proxy::forward(int from, int to, relay &r, bool readable){
+    if(readable && r.tail < sizeof(r.buffer) && (to < 0 || r.head == r.tail)){
+        ssize_t n = recv(from, r.buffer + r.tail, sizeof(r.buffer) - r.tail, ZSOCK_MSG_DONTWAIT);
+        if(n == 0){
+            return false;
+        } else if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK){
+            return false;
+        }
+        r.tail += MAX(n, 0);
+    }
+    if(to < 0 || r.head == r.tail){
+        return true;
+    }
+    ssize_t n = send(to, r.buffer + r.head, r.tail - r.head, ZSOCK_MSG_DONTWAIT);
+    if(n < 0){
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    r.head += n;
+    if(r.head == r.tail){
+        r.head = 0;
+        r.tail = 0;
+    }
+    return true;
+}
+
+void proxy::close(link &l){
+    (void)::close(l.client);
+    if(l.shard >= 0){
+        (void)::close(l.shard);
+    }
+    l.client = -1;
+    l.shard = -1;
+    l.up.head = l.up.tail = 0;
+    l.down.head = l.down.tail = 0;
+    open_links.dec();
+}
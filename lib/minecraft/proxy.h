@@ -0,0 +1,42 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+#include "admission.h"
+
+#define PROXY_CONNECTIONS 8     // clients relayed at once, logging in or playing
+#define PROXY_BUFFER_SIZE 1024  // per direction, a relay only reads once it is empty
+
+// Front of a sharded world. It reads a connection's Handshake and Login
+// Start, connects to the shard owning the player's spawn chunk and from
+// then on copies bytes both ways without looking at them. Server list
+// pings go to shard 0. One thread polls every socket; a direction only
+// reads when its buffer is empty and only writes while it is not, so a
+// slow side holds up its own connection and nothing else.
+class proxy {
+    public:
+    void run        (int listener, admission *gate); // returns only if poll fails
+
+    private:
+    struct relay {
+        uint8_t buffer[PROXY_BUFFER_SIZE];
+        uint16_t head = 0;
+        uint16_t tail = 0;
+    };
+    struct link {
+        int client = -1;
+        int shard = -1;         // -1 until routed
+        int64_t deadline = 0;   // for routing
+        relay up;               // client to shard, holds the login until routed
+        relay down;
+    };
+    link links[PROXY_CONNECTIONS];
+
+    void accept     (int listener, admission *gate);
+    bool route      (link &l);  // false on a bad login or an unreachable shard
+    bool forward    (int from, int to, relay &r, bool readable);
+    void close      (link &l);
+};
+
+#endif
@@ -0,0 +1,293 @@
+#include "shard.h"
+#include "minecraft.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/sys/byteorder.h>
+
+#define ENTRY_SIZE (4 + 3 * 8 + 1) // slot, flags, yaw, pitch, position, name length
+
+static counter border_sent("shard.sent");
+static counter border_received("shard.received");
+static counter border_malformed("shard.malformed");
+static counter mirrors_full("shard.mirrors_full");
+static gauge mirrored("shard.mirrors");
+
+BUILD_ASSERT(sizeof(((minecraft *)0)->players) / sizeof(((minecraft *)0)->players[0]) <= SHARD_SLOTS,
+             "every player slot needs a mirror slot on the peers");
+BUILD_ASSERT(2 + SHARD_SLOTS * (ENTRY_SIZE + USERNAME_LENGTH) <= SHARD_DATAGRAM_SIZE,
+             "a full border must fit one datagram");
+
+bool shard_address(uint8_t index, struct sockaddr_in *addr){
+    const char *s = CONFIG_MC_SHARD_ADDRS;
+    for(uint8_t i = 0; i < index && s; i++){
+        s = strchr(s, ',');
+        s = s ? s + 1 : NULL;
+    }
+    if(!s){
+        return false;
+    }
+    char host[24];
+    size_t len = strcspn(s, ",");
+    if(len >= sizeof(host)){
+        return false;
+    }
+    memcpy(host, s, len);
+    host[len] = 0;
+    uint16_t port = CONFIG_MC_SERVER_PORT;
+    char *colon = strchr(host, ':');
+    if(colon){
+        *colon = 0;
+        port = atoi(colon + 1);
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    return zsock_inet_pton(AF_INET, host, &addr->sin_addr) == 1;
+}
+
+// LINK
+bool shard_link::open(){
+    if(SHARDS == 1 || IS_ENABLED(CONFIG_MC_PROXY)){
+        return true;
+    }
+    S = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(S < 0){
+        return false;
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(CONFIG_MC_SHARD_PORT + SHARD_INDEX);
+    if(bind(S, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        (void)close(S);
+        S = -1;
+        return false;
+    }
+    return true;
+}
+
+bool shard_link::send(uint8_t peer, const entry *entries, uint8_t n){
+    struct sockaddr_in to;
+    if(S < 0 || !shard_address(peer, &to)){
+        return false;
+    }
+    to.sin_port = htons(CONFIG_MC_SHARD_PORT + peer);
+
+    uint8_t buf[SHARD_DATAGRAM_SIZE];
+    uint8_t *p = buf;
+    *p++ = SHARD_INDEX;
+    *p++ = n;
+    for(uint8_t i = 0; i < n; i++){
+        const entry &e = entries[i];
+        *p++ = e.slot;
+        *p++ = e.on_ground;
+        *p++ = e.yaw;
+        *p++ = e.pitch;
+        const double pos[3] = {e.x, e.y, e.z};
+        for(int k = 0; k < 3; k++){
+            uint64_t bits;
+            memcpy(&bits, &pos[k], sizeof(bits));
+            sys_put_be64(bits, p);
+            p += 8;
+        }
+        *p++ = e.name.length();
+        memcpy(p, e.name.c_str(), e.name.length());
+        p += e.name.length();
+    }
+    if(sendto(S, buf, p - buf, ZSOCK_MSG_DONTWAIT, (struct sockaddr *)&to, sizeof(to)) < 0){
+        return false;
+    }
+    border_sent.inc();
+    return true;
+}
+
+int shard_link::receive(uint8_t *peer, entry *entries, uint8_t max){
+    uint8_t buf[SHARD_DATAGRAM_SIZE];
+    if(S < 0){
+        return -1;
+    }
+    ssize_t len = recv(S, buf, sizeof(buf), ZSOCK_MSG_DONTWAIT);
+    if(len < 0){
+        return -1;
+    }
+    border_received.inc();
+    const uint8_t *p = buf;
+    const uint8_t *end = buf + len;
+    if(len < 2 || buf[0] >= SHARDS || buf[0] == SHARD_INDEX || buf[1] > max){
+        border_malformed.inc();
+        return -2;
+    }
+    *peer = buf[0];
+    uint8_t n = buf[1];
+    p += 2;
+    for(uint8_t i = 0; i < n; i++){
+        entry &e = entries[i];
+        if(end - p < ENTRY_SIZE || p[0] >= SHARD_SLOTS || p[ENTRY_SIZE - 1] > end - p - ENTRY_SIZE){
+            border_malformed.inc();
+            return -2;
+        }
+        e.slot = *p++;
+        e.on_ground = *p++;
+        e.yaw = *p++;
+        e.pitch = *p++;
+        double *pos[3] = {&e.x, &e.y, &e.z};
+        for(int k = 0; k < 3; k++){
+            uint64_t bits = sys_get_be64(p);
+            memcpy(pos[k], &bits, sizeof(bits));
+            p += 8;
+        }
+        uint8_t name_len = *p++;
+        e.name.assign((const char *)p, name_len);
+        p += name_len;
+    }
+    return n;
+}
+
+// BORDER
+// Every SHARD_UPDATE_TICKS each peer gets the players close to its region,
+// mirrors of the peers' players follow what they send. A mirror shows up
+// here like a player, with a uuid and a name of its own.
+void minecraft::updateShard(){
+    if(SHARDS == 1){
+        return;
+    }
+    if(tick % SHARD_UPDATE_TICKS == 0){
+        for(uint8_t peer = 0; peer < SHARDS; peer++){
+            if(peer == SHARD_INDEX){
+                continue;
+            }
+            shard_link::entry border[SHARD_SLOTS];
+            uint8_t n = 0;
+            double lo = peer * SHARD_WIDTH * 16;
+            double hi = lo + SHARD_WIDTH * 16;
+            for(auto &p : players){
+                if(!p.connected){
+                    continue;
+                }
+                uint32_t i = entity_index(p.entity);
+                if(entities.x[i] < lo - SHARD_BORDER || entities.x[i] >= hi + SHARD_BORDER){
+                    continue;
+                }
+                shard_link::entry &e = border[n++];
+                e.slot = p.id;
+                e.on_ground = entities.flags[i] & ENTITY_ON_GROUND;
+                e.yaw = angle(entities.yaw[i]);
+                e.pitch = angle(entities.pitch[i]);
+                e.x = entities.x[i];
+                e.y = entities.y[i];
+                e.z = entities.z[i];
+                e.name = p.username;
+            }
+            shard.send(peer, border, n);
+        }
+    }
+
+    int64_t now = k_uptime_get();
+    shard_link::entry in[SHARD_SLOTS];
+    uint8_t peer;
+    int n;
+    while((n = shard.receive(&peer, in, SHARD_SLOTS)) != -1){
+        if(n >= 0){
+            applyBorder(peer, in, n, now);
+        }
+    }
+    for(peer = 0; peer < SHARDS; peer++){
+        for(uint8_t slot = 0; slot < SHARD_SLOTS; slot++){
+            shard_mirror &m = shard.mirrors[peer][slot];
+            if(m.entity != ENTITY_NONE && now - m.seen > SHARD_TIMEOUT_MS){
+                dropMirror(peer, slot);
+            }
+        }
+    }
+}
+
+void minecraft::applyBorder(uint8_t peer, const shard_link::entry *in, uint8_t n, int64_t now){
+    bool listed[SHARD_SLOTS] = {};
+    for(uint8_t k = 0; k < n; k++){
+        const shard_link::entry &e = in[k];
+        shard_mirror &m = shard.mirrors[peer][e.slot];
+        listed[e.slot] = true;
+        if(m.entity != ENTITY_NONE && m.name != e.name.c_str()){
+            dropMirror(peer, e.slot); // the peer's slot went to someone else
+        }
+        if(m.entity == ENTITY_NONE){
+            m.entity = entities.create(ENTITY_MIRROR, SHARD_MIRROR_UUID | (peer * SHARD_SLOTS + e.slot), e.x, e.y, e.z);
+            if(m.entity == ENTITY_NONE){
+                mirrors_full.inc();
+                continue;
+            }
+            m.name = e.name;
+            mirrored.inc();
+        }
+        uint32_t i = entity_index(m.entity);
+        bool fresh = m.seen == 0;
+        m.seen = now;
+        if(!fresh && entities.x[i] == e.x && entities.y[i] == e.y && entities.z[i] == e.z &&
+           angle(entities.yaw[i]) == e.yaw && angle(entities.pitch[i]) == e.pitch){
+            continue;
+        }
+        entities.x[i] = e.x;
+        entities.y[i] = e.y;
+        entities.z[i] = e.z;
+        entities.yaw[i] = (e.yaw + 0.5f) * 360.0f / 256; // the middle of the step, angle() gives it back
+        entities.pitch[i] = ((int8_t)e.pitch + 0.5f) * 360.0f / 256;
+        if(fresh){
+            for(auto &p : players){
+                if(p.connected){
+                    p.writeMirror(m);
+                }
+            }
+        } else {
+            broadcastPlayerPosAndLook(e.x, e.y, e.z, e.yaw, e.pitch, e.on_ground, m.entity);
+        }
+    }
+    for(uint8_t slot = 0; slot < SHARD_SLOTS; slot++){
+        if(!listed[slot] && shard.mirrors[peer][slot].entity != ENTITY_NONE){
+            dropMirror(peer, slot);
+        }
+    }
+}
+
+void minecraft::dropMirror(uint8_t peer, uint8_t slot){
+    shard_mirror &m = shard.mirrors[peer][slot];
+    broadcastEntityDestroy(m.entity);
+    broadcastPlayerRemove(entities.owner[entity_index(m.entity)]);
+    entities.destroy(m.entity);
+    m.entity = ENTITY_NONE;
+    m.seen = 0;
+    mirrored.dec();
+}
+
+// Player Info and Spawn Player of a mirror, its owner field holds the uuid
+void minecraft::player::writeMirror(const shard_mirror &m){
+    entity_store &es = mc->entities;
+    uint32_t i = entity_index(m.entity);
+    {
+        packet p(S, &mtx, &out);
+        p.writeVarInt(0x32); // packet id
+        p.writeVarInt(0); // action add player
+        p.writeVarInt(1); // number of players
+        p.writeUUID(es.owner[i]);
+        p.writeString(m.name.c_str(), m.name.length());
+        p.writeVarInt(0); // no properties given
+        p.writeVarInt(1); // gamemode
+        p.writeVarInt(0); // ping, not known here
+        p.writeBoolean(0); // has display name
+        p.writePacket();
+    }
+    int yaw_i = angle(es.yaw[i]);
+    writeSpawnPlayer(es.x[i], es.y[i], es.z[i], yaw_i, angle(es.pitch[i]), m.entity, es.owner[i]);
+    writeEntityLook(yaw_i, m.entity);
+}
+
+void minecraft::player::writeMirrors(){
+    for(auto &peer : mc->shard.mirrors){
+        for(auto &m : peer){
+            if(m.entity != ENTITY_NONE){
+                writeMirror(m);
+            }
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/socket.h>
+#include "entities.h"
+#include "inline_string.h"
+#include "world.h"
+
+#define SHARDS CONFIG_MC_SHARDS
+#define SHARD_INDEX CONFIG_MC_SHARD_INDEX
+#define SHARD_WIDTH (WORLD_CHUNKS / SHARDS) // chunk columns along x per shard
+#define SHARD_BORDER 8.0        // blocks, players closer to a peer's region are mirrored there
+#define SHARD_SLOTS 8           // player slots of a peer, at least as many as a shard has
+#define SHARD_UPDATE_TICKS 2    // border state goes out at 10 Hz
+#define SHARD_TIMEOUT_MS 1000   // mirrors of a silent peer disappear
+#define SHARD_DATAGRAM_SIZE 384
+#define SHARD_MIRROR_UUID 0x80  // uuid byte of mirrors, clear of the local slots
+
+BUILD_ASSERT(WORLD_CHUNKS % SHARDS == 0, "every shard owns the same number of columns");
+BUILD_ASSERT(SHARD_INDEX < SHARDS, "shard index out of range");
+BUILD_ASSERT(SHARDS * SHARD_SLOTS <= 0x80, "mirror uuids must fit a byte");
+
+// Owner of the chunk column at cx. Shards own bands of columns along x.
+static inline uint8_t shard_owner(uint8_t cx){
+    return cx / SHARD_WIDTH;
+}
+
+// Spawn chunk of a player in a sharded world, picked from the name so
+// players spread over the shards. The proxy routes by it before the shard
+// has seen the login, both must agree.
+static inline void shard_spawn(const char *name, size_t len, uint8_t *cx, uint8_t *cz){
+    uint32_t h = 2166136261u; // FNV-1a
+    for(size_t i = 0; i < len; i++){
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    *cx = h % WORLD_CHUNKS;
+    *cz = (h >> 16) % WORLD_CHUNKS;
+}
+
+// Address of a shard from CONFIG_MC_SHARD_ADDRS, "a.b.c.d[:port]" in index
+// order. The port defaults to CONFIG_MC_SERVER_PORT.
+bool shard_address(uint8_t index, struct sockaddr_in *addr);
+
+// A player of a peer shard shown here while near the border.
+struct shard_mirror {
+    entity_id entity = ENTITY_NONE;
+    player_name name;
+    int64_t seen = 0;
+};
+
+// Border exchange with the peer shards, one UDP socket on
+// CONFIG_MC_SHARD_PORT + SHARD_INDEX. Every datagram holds the complete
+// border state of its sender, a player missing from it has left the
+// border. Lost datagrams need no recovery, the next one replaces them.
+// Game thread only.
+class shard_link {
+    public:
+    shard_mirror mirrors[SHARDS][SHARD_SLOTS];
+
+    struct entry {
+        uint8_t slot;
+        bool on_ground;
+        uint8_t yaw;
+        uint8_t pitch;
+        double x, y, z;
+        player_name name;
+    };
+
+    bool open       ();
+    bool send       (uint8_t peer, const entry *entries, uint8_t n);
+    int receive     (uint8_t *peer, entry *entries, uint8_t max); // entries, -1 if nothing came
+
+    private:
+    int S = -1;
+};
+
+#endif
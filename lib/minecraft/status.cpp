@@ -0,0 +1,127 @@
+#include "minecraft.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/socket.h>
+
+// STATUS
+// The server list response is encoded once at boot. The favicon and
+// description never change so they stay in flash, only the player section
+// in front of them is rebuilt when somebody joins or leaves.
+
+static const char status_prefix[] = "{\"version\": {\"name\": \"1.16.5\",\"protocol\": 754},\"players\": {";
+static const char status_suffix[] = "\"description\": {\"text\": \"A Minecraft server running on an ESP32!\"},\"favicon\":\"data:image/png;base64,iVBORw0KGgoAAAANSUhEUgAAAEAAAABACAMAAACdt4HsAAABU1BMVEUAAAAWMxcBAwELHwwBBAECCgMMIQ0AAgABAgEBBgEBBAEBBQEAAwECCAIDEAQDDgQDDgQDDAQLIAsQKhIZPRsBCAEBBgEDDgMIGwgGFgcKHwsUMhQDDwMGFwYCCAICCQIGFgcCCQMIHAkEEAQLIwwFEwUKHAoDDAMBAwEDDgMCCQIFEwUCCgIIHAkCCgIDCgMMJA0IGgkRLBISLBIEEQQBBQEBBgEDEAMEEAQBBAEFEwUDCwMHGggIGwgCCgMIGwgDDARMr1AAAAABBAFLrk9FoUlJqU1Bl0QjWiYHHAdKqk5Goko5hjw2gTkfTyEVOxYLJwwCDAI1fjg0fDcRMhIOLA9HpUtEnkgzejYtbzAsay4oYysmXyglXSchVSM/lUM6iD0SNhQPLxEIIAkFGAZEn0hDnUcqZywUOBYDEgQ3gjo/k0I+kUE8jkAxdTQbRhwaRhyU8jDPAAAAQXRSTlMABPsT0YwI9/Tr4LTw2tOHZVomEQf0y8ZoQjwN3a+vkYp6dm9dUyH65uW4tpeRc2hVKh4ZzMe+pKCYlSq8u6h/XiA2BHYAAAPMSURBVFjDzZdZVxNBEIU7Y0ICCRokgIiAiOACCIr7Pt+EhCxkIQlLgLAruP//JzM4xMx0JRLP8Rzv43RVddXtqtvT6l/D5/tbz+m+QNh/1wCj2x8O9F3tzHt4vAcPemaHL5rMpQnH28rXdra2dmp5y4kxceki7oEQQLm6tx43HaTX96plgFDgTyF8DyLA4WYybnoQT24eApHJtoW8GgTKKwlTRGKlDAw+bO0/H4RUKW22RLqUgmC0VfovgOWM2RaZZWBWLKMrDKcr5h/x6RTCXYL/U6gkzQsgWYGnWgRfGPJL5oWwlIewt4oXkJfKl4nIw6zbPwoVeX85hwpEXecf5DRpdoDkKcGHTQQMworZEVZg8DcNk7BsdohlmGzMT4RUptMAmRSR88kKQMnsGCW46SQQopzuPEC6zMCvFCbaMZhItOPxlrLRw6FsdbyRO4RUbuNYjn3IjTP9g02xWbZpYFtssk24Xg8wDlIPZY+AgaFnz4ZCQCordRPMnVVQieuLG8DjhdjZnE4NAhu6TfzArmEaPupre2DcUg1MGrCnW32ER6oPslKXGAuqCVMGqSVpmwUVgA/aypZ9Qi48gC3N7IPdS2FIawcAl30ewfFjaSmkYVT5OdEir8Jt5UEfrGqGeS6ru+SESbszojwYCQoTm+OeMoTv5XpgDX72pZ0UbGvfLd4oDfexNMNtLDkAry8eQCrtRC7hRCpBJHEHo9/r32+wI5LoJ6/fXnBNeRCFT0KqfjUmNNJakRsxt3+sl+Ka0Ehj6orUylW7R12om1WlVr6ipqRhWitguYqIWhTWdM2AKfVIHOcvFgS6Gjd3wML60mKcVa8oKFkLLscag4QlSFK8Qq99K8iS9hWMRUf3DfgqmOxCoL58HaqyaD9XDp7Lwl89E1W7hlRConFgUTlYDEkUJlLcOBebVUmy36kGJiTpXz2Xrf4IB94Ujovca5KErh6K694EDoj0N5pkQ5sGbnv0aEcX/ivnc9LNkVvvPsNj5cIT+OzWzSO6GxM3D7V48wF/t/l14brFD5dJrXngfE/cPGZttfXgLWTdDA41CffVEMXdZnqC09oLJthM9W6RAdcj5j0UGjR/02bRofpb45AKmvCPw75DZKZOz4jSMFKnOuMQuA9znmXfGOz/ymHLpkdA9Px2W9+HUZ/2s30fCjYPSf1e+z2USbv+AszEhN/1MSiW4vEcDCsRw5CLx1eLMBoTdxgHaiWYUS0wA6UaMOdTMvpCAEbLR9FVA2DA4V+0GAJetl5/CQy1f8TOd/deavOo7O2+5lP/GX4CF6CJedzJaM4AAAAASUVORK5CYII=\"}";
+
+#define STATUS_HEADER_MAX 7 // packet length + packet id + string length
+#define STATUS_HEAD_SIZE 640
+
+static uint8_t status_head[STATUS_HEAD_SIZE];
+static uint32_t status_head_start = 0;
+static uint32_t status_head_len = 0;
+static uint32_t status_version = 0; // a reply cut short resumes only on the same bytes
+static K_MUTEX_DEFINE(status_mtx);
+static gauge online("players");
+
+static uint32_t putVarInt(uint8_t *buf, uint32_t value){
+    uint32_t n = 0;
+    do {
+        uint8_t temp = (uint8_t)(value & 0b01111111);
+        value >>= 7;
+        if (value != 0) {
+            temp |= 0b10000000;
+        }
+        buf[n++] = temp;
+    } while (value != 0);
+    return n;
+}
+
+static uint32_t putSampleName(char *buf, const char *name){
+    uint32_t n = 0;
+    for(; *name && n < 16; name++){
+        if(*name == '"' || *name == '\\' || (uint8_t)*name < 0x20){
+            continue; // usernames never need these, drop them instead of escaping
+        }
+        buf[n++] = *name;
+    }
+    return n;
+}
+
+void minecraft::updateStatus(){
+    char *json = (char *)status_head + STATUS_HEADER_MAX;
+    uint32_t size = STATUS_HEAD_SIZE - STATUS_HEADER_MAX;
+    uint32_t len = sizeof(status_prefix) - 1;
+    uint8_t max = sizeof(players) / sizeof(players[0]);
+
+    k_mutex_lock(&status_mtx, K_FOREVER);
+    online.set(getPlayerNum());
+    memcpy(json, status_prefix, len);
+    len += snprintf(json + len, size - len, "\"max\": %u,\"online\": %u,\"sample\": [", max, getPlayerNum());
+    bool first = true;
+    for(auto &player : players){
+        if(!player.connected) continue;
+        len += snprintf(json + len, size - len, "%s{\"name\": \"", first ? "" : ",");
+        len += putSampleName(json + len, player.username.c_str());
+        len += snprintf(json + len, size - len, "\",\"id\": \"00000000-0000-0000-0000-0000000000%02x\"}", player.id);
+        first = false;
+    }
+    len += snprintf(json + len, size - len, "]},");
+
+    // prepend packet length, packet id and string length in front of the json
+    uint32_t json_len = len + sizeof(status_suffix) - 1;
+    uint8_t str_hdr[5];
+    uint32_t str_n = putVarInt(str_hdr, json_len);
+    uint8_t pkt_hdr[5];
+    uint32_t pkt_n = putVarInt(pkt_hdr, 1 + str_n + json_len);
+    status_head_start = STATUS_HEADER_MAX - (pkt_n + 1 + str_n);
+    uint8_t *h = status_head + status_head_start;
+    memcpy(h, pkt_hdr, pkt_n);
+    h[pkt_n] = 0x00; // packet id
+    memcpy(h + pkt_n + 1, str_hdr, str_n);
+    status_head_len = STATUS_HEADER_MAX - status_head_start + len;
+    status_version++;
+    k_mutex_unlock(&status_mtx);
+}
+
+// Never blocks, the accept thread serves every handshake. What the socket
+// does not take is resumed from *sent once it is writable again, as long
+// as the player list has not changed meanwhile.
+int minecraft::writeStatus(int S, uint32_t *sent, uint32_t *version){
+    uint8_t head[STATUS_HEAD_SIZE];
+
+    k_mutex_lock(&status_mtx, K_FOREVER);
+    if(*sent == 0){
+        *version = status_version;
+    } else if(*version != status_version){
+        k_mutex_unlock(&status_mtx);
+        return -1;
+    }
+    uint32_t len = status_head_len;
+    memcpy(head, status_head + status_head_start, len);
+    k_mutex_unlock(&status_mtx);
+
+    // one sendmsg, the suffix with the favicon goes out straight from flash
+    struct iovec iov[2] = {
+        {head, len},
+        {(void *)status_suffix, sizeof(status_suffix) - 1},
+    };
+    uint32_t total = len + sizeof(status_suffix) - 1;
+    uint32_t skip = *sent;
+    int first = 0;
+    if(skip >= len){
+        first = 1;
+        skip -= len;
+    }
+    iov[first].iov_base = (uint8_t *)iov[first].iov_base + skip;
+    iov[first].iov_len -= skip;
+
+    struct msghdr msg = {};
+    msg.msg_iov = iov + first;
+    msg.msg_iovlen = 2 - first;
+    ssize_t r = sendmsg(S, &msg, ZSOCK_MSG_DONTWAIT);
+    if(r < 0){
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    *sent += r;
+    return *sent == total ? 1 : 0;
+}
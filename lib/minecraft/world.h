@@ -0,0 +1,72 @@
+#ifndef WORLD_H
+#define WORLD_H
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+
+#define WORLD_CHUNKS 2          // chunks per side, the world spans 0..WORLD_CHUNKS*16
+#define CHUNK_SECTIONS 16       // sections per chunk column, the protocol's maximum
+#define WORLD_HEIGHT (CHUNK_SECTIONS * 16)
+#define SECTION_BLOCKS 4096     // 16x16x16, one palette index per block
+#define SECTION_WORDS (SECTION_BLOCKS / 32)
+#define WORLD_RETIRED 8         // emptied sections waiting for their last reader
+#define WORLD_BUCKETS 16        // hash chains of the section store
+
+// The block data of the world. Only sections holding at least one block
+// exist, air costs nothing, so a full height world is as cheap as its
+// contents. Sections are hash-consed: every distinct content is stored
+// once and shared by all positions holding it, flat layers cost a single
+// section however wide the world is. A section starts out as a handle to
+// its template in flash and only gets a RAM copy once one of its blocks is
+// changed, a shared one is copied first; a section that becomes all air
+// again is dropped.
+// Collision only needs to know whether a block is solid, that is kept as
+// one bit per block (y, z, x order) so a query is a handful of bit tests.
+// Only the game thread changes the world. Other threads sending sections
+// hold() the world meanwhile, a section is only changed in place while
+// nobody does, otherwise the change goes to a copy and the old one is freed
+// once the last reader lets go.
+class world {
+    public:
+    world();
+    ~world();
+    bool init               (); // loads the templates, false if the world pool is spent
+
+    const uint8_t *section  (uint8_t x, uint8_t z, uint8_t y); // wire layout, 512 big endian longs, NULL if all air
+    uint16_t sectionMask    (uint8_t x, uint8_t z); // bit y set for every section holding blocks
+    uint16_t blockCount     (uint8_t x, uint8_t z, uint8_t y); // non-air blocks
+    uint8_t getBlock        (int x, int y, int z);
+    bool setBlock           (int x, int y, int z, uint8_t block); // false outside the world or if the pool is spent
+
+    bool solid              (int x, int y, int z);
+    bool collides           (double x0, double y0, double z0, double x1, double y1, double z1); // box against solid blocks
+
+    void hold               ();
+    void release            ();
+
+    private:
+    struct section_data {
+        const uint8_t *blocks;
+        uint32_t mask[SECTION_WORDS];   // solidity bits
+        uint16_t count;                 // solid blocks, air is the only non solid block
+        bool owned;                     // blocks were copied to RAM
+        uint16_t refs;                  // positions holding this content
+        uint32_t hash;
+        section_data *next;             // hash chain
+    };
+
+    section_data *sections[WORLD_CHUNKS][WORLD_CHUNKS][CHUNK_SECTIONS] = {};
+    section_data *retired[WORLD_RETIRED] = {};
+    section_data *buckets[WORLD_BUCKETS] = {};
+    atomic_t readers = ATOMIC_INIT(0);
+
+    bool intern             (const uint8_t *blocks, bool owned, section_data **out);
+    section_data *publish   (section_data *s, bool visible);
+    void unlink             (section_data *s);
+    void drop               (section_data *s);
+    void retire             (section_data *s);
+    void destroy            (section_data *s);
+    void collect            ();
+};
+
+#endif
@@ -5,6 +5,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/logging/log_ctrl.h>
@@ -16,11 +17,15 @@
 #include <zephyr/net/conn_mgr_monitor.h>
 
 #include <minecraft.h>
+#include <handshake.h>
+#include <admission.h>
+#include <proxy.h>
 
 #if defined(CONFIG_POSIX_API)
 #include <zephyr/posix/arpa/inet.h>
 #include <zephyr/posix/unistd.h>
 #include <zephyr/posix/sys/socket.h>
+#include <zephyr/posix/poll.h>
 #endif
 
 LOG_MODULE_REGISTER(udp_sample, CONFIG_UDP_SAMPLE_LOG_LEVEL);
@@ -32,7 +37,7 @@ LOG_MODULE_REGISTER(udp_sample, CONFIG_UDP_SAMPLE_LOG_LEVEL);
 #if defined(CONFIG_NET_HOSTNAME)
 /* Register service */
 DNS_SD_REGISTER_TCP_SERVICE(http_server_sd, CONFIG_NET_HOSTNAME, "_http", "local",
-			    DNS_SD_EMPTY_TXT, 25565);
+			    DNS_SD_EMPTY_TXT, CONFIG_MC_SERVER_PORT);
 #endif /* CONFIG_NET_HOSTNAME */
 
 /* Macro called upon a fatal error, reboots the device. */
@@ -51,22 +56,33 @@ static K_SEM_DEFINE(network_connected_sem, 0, 1);
 static int fd;
 static struct sockaddr_storage host_addr;
 
-typedef struct{
-    int socket;
-    uint8_t id;
-} clients;
-
 #define MAX_PLAYERS 5
-#define STACK_SIZE 16384
-clients serverClients[MAX_PLAYERS];
+#define MAX_HANDSHAKES CONFIG_MC_MAX_HANDSHAKES
+#define STACK_SIZE CONFIG_MC_HANDLER_STACK_SIZE
+
+/* Connections that have not logged in yet, status pings never leave here */
+static handshake handshakes[MAX_HANDSHAKES];
+static admission admission_control;
+static int tcp4_sock = -1;
+
+#if defined(CONFIG_MC_PROXY)
+/* Routes clients to the shards, this instance runs no world of its own */
+static proxy front;
+#endif
 
 /* Processing threads for incoming connections */
 K_THREAD_STACK_ARRAY_DEFINE(tcp4_handler_stack, MAX_PLAYERS, STACK_SIZE);
 static struct k_thread tcp4_handler_thread[MAX_PLAYERS];
 static k_tid_t tcp4_handler_tid[MAX_PLAYERS];
+static bool tcp4_handler_started[MAX_PLAYERS];
 
 minecraft mc;
 
+/* Per client rtt, backlog and stall time in the mc stats dump */
+static report players_report("players", [](metrics_print_t print, void *ctx) {
+	mc.printPlayers(print, ctx);
+});
+
 #define THREAD_PRIORITY			K_PRIO_COOP(CONFIG_NUM_COOP_PRIORITIES - 1)
 
 static int setup_server(int *sock, struct sockaddr *bind_addr, socklen_t bind_addrlen)
@@ -104,26 +120,93 @@ static int setup_server(int *sock, struct sockaddr *bind_addr, socklen_t bind_ad
 
 static void client_conn_handler(void *ptr1, void *ptr2, void *ptr3)
 {
-	ARG_UNUSED(ptr1);
-    clients client = *(clients*)ptr2;
+	ARG_UNUSED(ptr2);
+	ARG_UNUSED(ptr3);
+	int slot = POINTER_TO_INT(ptr1);
+
+	/* A refused join already told the client, nothing to read from it */
+	if (mc.players[slot].join()) {
+		/* handle() blocks in recv, a kick shuts the socket down to end it */
+		while (mc.players[slot].handle()) {
+		}
+	}
 
-	int ret;
+    /* The game thread tears the player down and frees the slot */
+    mc.players[slot].post({EVENT_LEAVE, mc.players[slot].id});
+}
 
-    if(!mc.players[client.id].join()){  // try to join, end task if fail
-        goto end;
-    }
+static void start_player(handshake *hs)
+{
+	int slot;
 
-	while (true) {
-        mc.players[client.id].handle();
-		k_msleep(10);
-	};
+	for (slot = 0; slot < MAX_PLAYERS; slot++) {
+		if (mc.players[slot].S < 0) {
+			break;
+		}
+	}
 
-    mc.broadcastEntityDestroy(mc.players[client.id].id);
-    mc.broadcastChatMessage(mc.players[client.id].username + " left the server", "Server");
-    end:
-	(void)close(client.socket);
+	if (slot == MAX_PLAYERS) {
+		LOG_WRN("No free player slot for %s", hs->username.c_str());
+		hs->refuse("Server full");
+		return;
+	}
 
-	client.socket = -1;
+	/* The previous handler released the slot as its last action, make sure
+	 * it has returned before its thread object and stack are reused.
+	 */
+	if (tcp4_handler_started[slot]) {
+		k_thread_join(&tcp4_handler_thread[slot], K_FOREVER);
+	}
+
+	mc.players[slot].S = hs->S;
+	mc.players[slot].username = hs->username;
+
+	tcp4_handler_tid[slot] = k_thread_create(
+		&tcp4_handler_thread[slot],
+		tcp4_handler_stack[slot],
+		K_THREAD_STACK_SIZEOF(tcp4_handler_stack[slot]),
+		(k_thread_entry_t)client_conn_handler,
+		INT_TO_POINTER(slot),
+		NULL,
+		NULL,
+		THREAD_PRIORITY,
+		0, K_NO_WAIT);
+	k_thread_name_set(tcp4_handler_tid[slot], "mc_player");
+	tcp4_handler_started[slot] = true;
+}
+
+static void accept_client(void)
+{
+	struct sockaddr_in6 client_addr;
+	socklen_t client_addr_len = sizeof(client_addr);
+	int client;
+
+	client = accept(tcp4_sock, (struct sockaddr *)&client_addr, &client_addr_len);
+	if (client < 0) {
+		LOG_ERR("Error in accept %d, try again", -errno);
+		return;
+	}
+
+	uint32_t source;
+	if (client_addr.sin6_family == AF_INET) {
+		source = ((struct sockaddr_in *)&client_addr)->sin_addr.s_addr;
+	} else {
+		memcpy(&source, &client_addr.sin6_addr.s6_addr[12], sizeof(source));
+	}
+	if (!admission_control.admit(source, k_uptime_get())) {
+		(void)close(client);
+		return;
+	}
+
+	for (int i = 0; i < MAX_HANDSHAKES; i++) {
+		if (handshakes[i].S < 0) {
+			handshakes[i].open(client);
+			return;
+		}
+	}
+
+	/* Handshake budget exhausted, players already logged in are unaffected */
+	(void)close(client);
 }
 
 static void process_tcp4(void)
@@ -131,51 +214,78 @@ static void process_tcp4(void)
 	int ret;
 	struct sockaddr_in addr4 = {
 		.sin_family = AF_INET,
-		.sin_port = htons(25565),
+		.sin_port = htons(CONFIG_MC_SERVER_PORT),
 	};
 
-	int i = 0;
-	for(i = 0; i < MAX_PLAYERS; i++){
-		if (serverClients[i].socket == 0) {
-			break;
-		}
-	}
-	int slot = i;
-
-	int *tcp4_sock = &serverClients[i].socket;
-
-	ret = setup_server(tcp4_sock, (struct sockaddr *)&addr4, sizeof(addr4));
+	ret = setup_server(&tcp4_sock, (struct sockaddr *)&addr4, sizeof(addr4));
 	if (ret < 0) {
 		LOG_ERR("Failed to create IPv4 socket %d", ret);
 		return;
 	}
 
-	LOG_INF("Waiting for IPv4 HTTP connections on port %d, sock %d", 25565, serverClients[i].socket);
+	LOG_INF("Waiting for IPv4 HTTP connections on port %d, sock %d", CONFIG_MC_SERVER_PORT, tcp4_sock);
 
-	int client;
+#if defined(CONFIG_MC_PROXY)
+	front.run(tcp4_sock, &admission_control);
+	LOG_ERR("Error in proxy poll %d", -errno);
+	return;
+#endif
 
 	while (true) {
-		struct sockaddr_in6 client_addr;
-		socklen_t client_addr_len = sizeof(client_addr);
-		char addr_str[INET6_ADDRSTRLEN];
-
-		client = accept(*tcp4_sock, (struct sockaddr *)&client_addr,
-				&client_addr_len);
-		if (client < 0) {
-			LOG_ERR("Error in accept %d, try again", -errno);
+		struct pollfd fds[1 + MAX_HANDSHAKES];
+
+		fds[0].fd = tcp4_sock;
+		fds[0].events = POLLIN;
+		for (int i = 0; i < MAX_HANDSHAKES; i++) {
+			fds[1 + i].fd = handshakes[i].S;
+			fds[1 + i].events = handshakes[i].writing() ? POLLOUT : POLLIN;
+		}
+
+		/* Only pending handshakes have a deadline to wake up for */
+		int64_t now = k_uptime_get();
+		int timeout = -1;
+		for (int i = 0; i < MAX_HANDSHAKES; i++) {
+			if (handshakes[i].S >= 0) {
+				int left = MAX(handshakes[i].deadline - now, 0);
+				timeout = (timeout < 0) ? left : MIN(timeout, left);
+			}
+		}
+
+		ret = poll(fds, ARRAY_SIZE(fds), timeout);
+		if (ret < 0) {
+			LOG_ERR("Error in poll %d", -errno);
 			return;
 		}
 
-		tcp4_handler_tid[slot] = k_thread_create(
-			&tcp4_handler_thread[slot],
-			tcp4_handler_stack[slot],
-			K_THREAD_STACK_SIZEOF(tcp4_handler_stack[slot]),
-			(k_thread_entry_t)client_conn_handler,
-			INT_TO_POINTER(slot),
-			&serverClients[i],
-			&tcp4_handler_tid[slot],
-			THREAD_PRIORITY,
-			0, K_NO_WAIT);
+		for (int i = 0; i < MAX_HANDSHAKES; i++) {
+			if (handshakes[i].S < 0 || fds[1 + i].revents == 0) {
+				continue;
+			}
+
+			handshake::result r = handshakes[i].writing() ?
+				handshakes[i].resume(&mc) : handshakes[i].feed(&mc);
+
+			switch (r) {
+			case handshake::NEED_MORE:
+				break;
+			case handshake::LOGIN:
+				start_player(&handshakes[i]);
+				handshakes[i].release();
+				break;
+			default:
+				handshakes[i].close();
+				break;
+			}
+		}
+
+		now = k_uptime_get();
+		for (int i = 0; i < MAX_HANDSHAKES; i++) {
+			handshakes[i].expire(now);
+		}
+
+		if (fds[0].revents & POLLIN) {
+			accept_client();
+		}
 	}
 }
 
@@ -246,21 +356,30 @@ int main(void)
 	}
 
     for (int i = 0; i < MAX_PLAYERS; i++) {
-        mc.players[i].S = serverClients[i].socket;
         mc.players[i].id = i;
-        serverClients[i].id = i;
         mc.players[i].mc = &mc;
     }
+    if (!mc.map.init()) {
+        LOG_ERR("World does not fit CONFIG_MC_WORLD_POOL_SIZE");
+        FATAL_ERROR();
+        return -ENOMEM;
+    }
+    mc.buildJoinBundle();
+    mc.updateStatus();
 
 	k_sem_take(&network_connected_sem, K_FOREVER);
 
+	if (!mc.shard.open()) {
+		LOG_ERR("Failed to open the shard link, border players stay hidden");
+	}
+
 	k_msleep(3000);
 
 	k_thread_start(tcp4_thread_id);
 
+	/* main is the game logic thread from here on */
 	while (true) {
-        mc.handle();
-        k_msleep(20000);
+        mc.update();
 	}
 
 	return 0;